@@ -11,14 +11,77 @@
 *     - Initial version 
 *
 ******************************************************************************/
+#include <unistd.h>
 #include "common.h"
+#include "uds_shm.h"
 
 
-int main(void)
+/*
+ * Change the configuration of server via the admin socket, and print the
+ * configuration after change.
+ */
+int admin_config(const char *text)
 {
     uds_client_t *clnt;
+    uds_command_t *req, *res;
+    size_t len = strlen(text);
 
-    clnt = client_init(UDS_SOCK_PATH, 10);
+    clnt = client_init(UDS_ADMIN_SOCK_PATH, 0);
+    if (clnt == NULL) {
+        printf("client: init error\n");
+        return STATUS_INIT_ERROR;
+    }
+
+    req = (uds_command_t *)uds_malloc(sizeof(uds_command_t) + len);
+    if (req == NULL) {
+        client_close(clnt);
+        return STATUS_ERROR;
+    }
+    req->command = UDS_CMD_SET_CONFIG;
+    req->data_len = len;
+    memcpy(req + 1, text, len);
+
+    res = client_send_request(clnt, req);
+    if ((res == NULL) || (res->status != STATUS_SUCCESS)) {
+        printf("client: UDS_CMD_SET_CONFIG error\n");
+        uds_free(res);
+        uds_free(req);
+        client_close(clnt);
+        return STATUS_ERROR;
+    }
+    uds_free(res);
+
+    req->command = UDS_CMD_GET_CONFIG;
+    req->data_len = 0;
+    res = client_send_request(clnt, req);
+    if ((res != NULL) && (res->status == STATUS_SUCCESS)) {
+        printf("%.*s", (int)res->data_len, (char *)(res + 1));
+    }
+
+    uds_free(res);
+    uds_free(req);
+    client_close(clnt);
+    return STATUS_SUCCESS;
+}
+
+
+int main(int argc, char *argv[])
+{
+    uds_client_t *clnt;
+    uds_client_config_t cfg;
+
+    if (argc > 1) {
+        /* e.g. ./client "max_client = 20" */
+        return admin_config(argv[1]);
+    }
+
+    client_config_init(&cfg);
+    cfg.connect_timeout = 10;
+    if (client_config_load_env(&cfg) != 0) {
+        return STATUS_INIT_ERROR;
+    }
+
+    clnt = client_init_config(UDS_SOCK_PATH, &cfg);
     if (clnt == NULL) {
         printf("client: init error\n");
         return STATUS_INIT_ERROR;
@@ -50,45 +113,55 @@ int main(void)
             printf("client: CMD_GET_VERSION error(%d)\n", ver->common.status);
         }
 
-        free(ver);
+        uds_free(ver);
     }
 
     /********************** Get message from server ***********************/
     {
         uds_command_t req;
-        uds_response_get_msg_t *res;
+        uds_command_t *res;
+        uds_msg_t msg;
+        const char *str;
+        uint32_t pid = 0;
 
         req.command = CMD_GET_MESSAGE;
         req.data_len = 0;
 
-        res = (uds_response_get_msg_t *)client_send_request(clnt, &req);
+        res = client_send_request(clnt, &req);
         if (res == NULL) {
             printf("client: send request error\n");
             client_close(clnt);
             return STATUS_ERROR;
         }
 
-        if (res->common.status == STATUS_SUCCESS) {
-            printf("Message: %s\n", res->data);
+        if (res->status != STATUS_SUCCESS) {
+            printf("client: CMD_GET_MESSAGE error(%d)\n", res->status);
+        } else if ((msg_view_init(&msg, res) != 0) ||
+                ((str = msg_get_string(&msg, MESSAGE_FIELD_TEXT)) == NULL)) {
+            printf("client: invalid message\n");
         } else {
-            printf("client: CMD_GET_MESSAGE error(%d)\n", res->common.status);
+            msg_get_u32(&msg, MESSAGE_FIELD_PID, &pid);
+            printf("Message: %s (from pid %u)\n", str, pid);
         }
 
-        free(res);
+        uds_free(res);
     }
 
     /********************** Put message to server ***********************/
     {
-        uds_request_put_msg_t req;
+        uint8_t buf[256];
+        uds_msg_builder_t b;
+        uds_command_t *req;
         uds_command_t *res;
         char str[] = "This is a message from client";
 
-        req.common.command = CMD_PUT_MESSAGE;
-        req.common.data_len = strlen(str)+1;
-        snprintf((char *)req.data, UDS_PUT_MSG_SIZE-1, "%s", str);
-        req.data[UDS_PUT_MSG_SIZE-1] = 0;
+        msg_builder_init(&b, buf, sizeof(buf), CMD_PUT_MESSAGE,
+            MESSAGE_FIELD_COUNT);
+        msg_add_string(&b, MESSAGE_FIELD_TEXT, str);
+        msg_add_u32(&b, MESSAGE_FIELD_PID, (uint32_t)getpid());
+        req = msg_builder_finish(&b);
 
-        res = (uds_command_t *)client_send_request(clnt, (uds_command_t *)&req);
+        res = client_send_request(clnt, req);
         if (res == NULL) {
             printf("client: send request error\n");
             client_close(clnt);
@@ -101,7 +174,61 @@ int main(void)
             printf("client: CMD_PUT_MESSAGE error(%d)\n", res->status);
         }
 
-        free(res);
+        uds_free(res);
+    }
+
+    /********************** Send requests in an envelope ***********************/
+    {
+        uds_command_t ver, msg;
+        uds_command_t *reqs[2] = { &ver, &msg };
+        uds_command_t *res;
+        const uds_command_t *sub;
+        uds_multi_iter_t it;
+
+        ver.command = CMD_GET_VERSION;
+        ver.data_len = 0;
+        msg.command = CMD_GET_MESSAGE;
+        msg.data_len = 0;
+
+        res = client_send_multi(clnt, reqs, 2, UDS_MULTI_PARALLEL);
+        if (res == NULL) {
+            printf("client: send request error\n");
+            client_close(clnt);
+            return STATUS_ERROR;
+        }
+
+        if ((res->status != STATUS_SUCCESS) ||
+                (multi_iter_init(&it, res) != 0)) {
+            printf("client: UDS_CMD_MULTI error(%d)\n", res->status);
+        } else {
+            while ((sub = multi_iter_next(&it)) != NULL) {
+                printf("client: sub-response status(%d), %u bytes\n",
+                    sub->status, sub->data_len);
+            }
+        }
+
+        uds_free(res);
+    }
+
+    /********************** Read version from snapshot *******************/
+    {
+        const struct uds_snapshot *snap;
+        uint8_t data[2];
+        uint32_t version;
+
+        snap = client_map_snapshot(clnt);
+        if (snap == NULL) {
+            printf("client: map snapshot error\n");
+        } else {
+            if (snapshot_read(snap, data, sizeof(data), &version) ==
+                    sizeof(data)) {
+                printf("Version in snapshot(v%u): %d.%d\n", version,
+                    data[0], data[1]);
+            } else {
+                printf("client: read snapshot error\n");
+            }
+            client_unmap_snapshot(snap);
+        }
     }
 
     /********************** Send an unknown request to server ***********************/
@@ -121,7 +248,7 @@ int main(void)
 
         printf("client: response status(%d)\n", res->status);
 
-        free(res);
+        uds_free(res);
     }
 
     client_close(clnt);
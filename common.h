@@ -14,12 +14,15 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 #include "uds.h"
+#include "uds_msg.h"
 
 
 /*--------------------------------------------------------------
  * Definition for both client and server
  *--------------------------------------------------------------*/
 #define UDS_SOCK_PATH           "/tmp/uds.1234"
+#define UDS_ADMIN_SOCK_PATH     "@uds.1234.admin"
+#define UDS_PROXY_SOCK_PATH     "/tmp/uds.1234.proxy"
 
 /* Extra status code, refer STATUS_ERROR defined in uds.h,
  * the values used in struct uds_command_t.status */
@@ -45,20 +48,14 @@ typedef struct uds_response_version {
 } BYTE_ALIGNED uds_response_version_t;
 
 
-/* Response for CMD_GET_MESSAGE */
-#define UDS_GET_MSG_SIZE        256
-typedef struct uds_response_get_msg {
-    uds_command_t common;           /* Common header of response */
-    char data[UDS_GET_MSG_SIZE];    /* Data from server to client */
-} BYTE_ALIGNED uds_response_get_msg_t;
+/* Fields of the message (uds_msg.h) in the response for CMD_GET_MESSAGE
+ * and the request for CMD_PUT_MESSAGE */
+enum uds_message_field {
+    MESSAGE_FIELD_TEXT,         /* string, the message */
+    MESSAGE_FIELD_PID,          /* u32, the process id of sender */
 
-
-/* Request for CMD_PUT_MESSAGE */
-#define UDS_PUT_MSG_SIZE       256
-typedef struct uds_request_put_msg {
-    uds_command_t common;           /* Common header of request */
-    char data[UDS_PUT_MSG_SIZE];    /* Data from client to server */
-} BYTE_ALIGNED uds_request_put_msg_t;
+    MESSAGE_FIELD_COUNT
+};
 
 
 #endif /* _COMMON_H_ */
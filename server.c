@@ -18,43 +18,32 @@
 volatile sig_atomic_t loop_flag = 1;
 
 
-/*
- * Return the version of server.
- */
-uds_command_t *cmd_get_version(void)
-{
-    uds_response_version_t *ver;
-
-    printf("CMD_GET_VERSION\n");
-
-    ver = (uds_response_version_t *)malloc(sizeof(uds_response_version_t));
-    if (ver != NULL) {
-        ver->common.status = STATUS_SUCCESS;
-        ver->common.data_len = 2;
-        ver->major = 1;
-        ver->minor = 0;
-    }
-
-    return (uds_command_t *)ver;
-}
-
-
 /*
  * Get a message string from server
  */
 uds_command_t *cmd_get_msg(void)
 {
-    uds_response_get_msg_t *res;
+    uds_msg_builder_t b;
     const char *str = "This is a message from the server.";
+    size_t size;
+    void *res;
 
     printf("CMD_GET_MESSAGE\n");
 
-    res = (uds_response_get_msg_t *)malloc(sizeof(uds_response_get_msg_t));
-    if (res != NULL) {
-        res->common.status = STATUS_SUCCESS;
-        res->common.data_len = strlen(str);
-        snprintf(res->data, UDS_GET_MSG_SIZE, "%s", str);
-        res->data[UDS_GET_MSG_SIZE-1] = 0;
+    /* Only the bytes of the fields are sent */
+    size = sizeof(uds_command_t) + UDS_MSG_TABLE_SIZE(MESSAGE_FIELD_COUNT) +
+        strlen(str) + 1 + sizeof(uint32_t);
+    res = uds_malloc(size);
+    if (res == NULL) {
+        return NULL;
+    }
+
+    msg_builder_init(&b, res, size, STATUS_SUCCESS, MESSAGE_FIELD_COUNT);
+    msg_add_string(&b, MESSAGE_FIELD_TEXT, str);
+    msg_add_u32(&b, MESSAGE_FIELD_PID, (uint32_t)getpid());
+    if (msg_builder_finish(&b) == NULL) {
+        uds_free(res);
+        return NULL;
     }
 
     return (uds_command_t *)res;
@@ -67,15 +56,25 @@ uds_command_t *cmd_get_msg(void)
 uds_command_t *cmd_put_msg(uds_command_t *req)
 {
     uds_command_t *res;
-    uds_request_put_msg_t *put_msg = (uds_request_put_msg_t *)req;
+    uds_msg_t msg;
+    const char *str;
+    uint32_t pid = 0;
 
     printf("CMD_PUT_MESSAGE\n");
 
-    printf("Message: %s\n", (char *)put_msg->data);
+    /* Validate the message once, then read the fields in place */
+    if ((msg_view_init(&msg, req) != 0) ||
+            ((str = msg_get_string(&msg, MESSAGE_FIELD_TEXT)) == NULL)) {
+        str = NULL;
+        printf("Invalid message\n");
+    } else {
+        msg_get_u32(&msg, MESSAGE_FIELD_PID, &pid);
+        printf("Message: %s (from pid %u)\n", str, pid);
+    }
 
-    res = (uds_command_t *)malloc(sizeof(uds_command_t));
+    res = (uds_command_t *)uds_malloc(sizeof(uds_command_t));
     if (res != NULL) {
-        res->status = STATUS_SUCCESS;
+        res->status = (str != NULL) ? STATUS_SUCCESS : STATUS_ERROR;
         res->data_len = 0;
     }
 
@@ -92,7 +91,7 @@ uds_command_t *cmd_unknown(uds_command_t *req)
 
     printf("Unknown request type\n");
 
-    res = (uds_command_t *)malloc(sizeof(uds_command_t));
+    res = (uds_command_t *)uds_malloc(sizeof(uds_command_t));
     if (res != NULL) {
         res->status = STATUS_INVALID_COMMAND;
         res->data_len = 0;
@@ -110,10 +109,6 @@ uds_command_t *my_request_handler(uds_command_t *req)
     uds_command_t *resp = NULL;
 
     switch (req->command) {
-    case CMD_GET_VERSION:
-        resp = cmd_get_version();
-        break;
-
     case CMD_GET_MESSAGE:
         resp = cmd_get_msg();
         break;
@@ -150,22 +145,122 @@ void install_sig_handler()
 }
 
 
-int main(void)
+/*
+ * Print the statistics of server.
+ */
+void print_stats(uds_server_t *s)
+{
+    uds_stats_t st;
+
+    server_get_stats(s, &st);
+    printf("Connections: %llu, rejected: %llu\n",
+        (unsigned long long)st.connections, (unsigned long long)st.rejected);
+    printf("Requests: %llu, errors: %llu, busy: %llu, rate limited: %llu\n",
+        (unsigned long long)st.requests, (unsigned long long)st.errors,
+        (unsigned long long)st.busy, (unsigned long long)st.rate_limited);
+    printf("Worker restarts: %llu, slow requests: %llu\n",
+        (unsigned long long)st.worker_restarts,
+        (unsigned long long)st.slow_requests);
+    if (st.sockbuf_resizes) {
+        printf("Socket buffers: %llu resizes, sndbuf %llu, rcvbuf %llu bytes\n",
+            (unsigned long long)st.sockbuf_resizes,
+            (unsigned long long)st.sndbuf_bytes,
+            (unsigned long long)st.rcvbuf_bytes);
+    }
+    if (st.envelopes) {
+        printf("Envelopes: %llu, sub-requests: %llu\n",
+            (unsigned long long)st.envelopes,
+            (unsigned long long)st.sub_requests);
+    }
+    if (st.spin_hits + st.spin_misses) {
+        printf("Busy poll: %llu hits, %llu misses, %.1f us per spin\n",
+            (unsigned long long)st.spin_hits,
+            (unsigned long long)st.spin_misses,
+            st.spin_ns / 1000.0 / (st.spin_hits + st.spin_misses));
+    }
+}
+
+
+void usage(const char *prog)
+{
+    printf("Usage: %s [-c config] [-w workers]\n", prog);
+    printf("  -c config   Load the configuration from a file\n");
+    printf("  -w workers  Run in pre-fork mode with some worker processes\n");
+    printf("The configuration can be overridden by environment variables,\n");
+    printf("e.g. UDS_MAX_CLIENT=100\n");
+}
+
+
+int main(int argc, char *argv[])
 {
     uds_server_t *s;
+    uds_server_config_t cfg;
+    uds_listener_attr_t admin_attr;
+    uds_response_version_t ver;
+    int opt;
+
+    server_config_init(&cfg);
+    cfg.snapshot_size = 64;     /* Room for the version */
+    while ((opt = getopt(argc, argv, "c:w:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            if (server_config_load_file(&cfg, optarg) != 0) {
+                return STATUS_INIT_ERROR;
+            }
+            break;
+
+        case 'w':
+            cfg.engine = UDS_ENGINE_PREFORK;
+            cfg.workers = atoi(optarg);
+            break;
+
+        default:
+            usage(argv[0]);
+            return STATUS_ERROR;
+        }
+    }
+    if (server_config_load_env(&cfg) != 0) {
+        return STATUS_INIT_ERROR;
+    }
 
-    s = server_init(UDS_SOCK_PATH, &my_request_handler);
+    s = server_init_config(UDS_SOCK_PATH, &my_request_handler, &cfg);
     if (s == NULL) {
         printf("server: init error\n");
         return STATUS_INIT_ERROR;
     }
 
-    install_sig_handler();
+    /* The version is the same on every call, the library answers it with
+     * a response encoded once */
+    ver.major = 1;
+    ver.minor = 0;
+    if (server_set_const_response(s, CMD_GET_VERSION, STATUS_SUCCESS,
+            &ver.major, sizeof(ver) - sizeof(uds_command_t)) != 0) {
+        printf("server: set version error\n");
+        server_close(s);
+        return STATUS_INIT_ERROR;
+    }
+
+    /* Clients can read the version from the snapshot without a request */
+    if ((cfg.snapshot_size > 0) &&
+            (server_publish_snapshot(s, &ver.major, 2) != 0)) {
+        printf("server: publish snapshot error\n");
+    }
 
-    while (loop_flag) {
-        server_accept_request(s);
+    /* A socket for administration, e.g. change the configuration */
+    memset(&admin_attr, 0, sizeof(admin_attr));
+    admin_attr.max_client = 1;
+    admin_attr.admin = 1;
+    if (server_add_listener(s, UDS_ADMIN_SOCK_PATH, &admin_attr) != 0) {
+        printf("server: init admin socket error\n");
+        server_close(s);
+        return STATUS_INIT_ERROR;
     }
 
+    install_sig_handler();
+
+    server_run(s, &loop_flag);
+
+    print_stats(s);
     server_close(s);
     return STATUS_SUCCESS;
 }
@@ -16,79 +16,284 @@
 *     - Add timeout to client(waiting for server to be ready)
 *
 ******************************************************************************/
+#define _GNU_SOURCE     /* struct ucred */
 #include <unistd.h>
+#include <stddef.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <linux/membarrier.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <dirent.h>
 #include "uds.h"
+#include "uds_shm.h"
+
+
+/* Update a counter in the statistics of server */
+#define STAT_ADD(s, field, n) \
+    __atomic_add_fetch(&(s)->stats->field, (n), __ATOMIC_RELAXED)
+
+/* Add a counter of statistics to the total */
+#define STAT_SUM(total, st, field) \
+    ((total)->field += __atomic_load_n(&(st)->field, __ATOMIC_RELAXED))
+
+/* Print a message if the log level of server is high enough, in a
+ * request of connection thread (see live_config()) */
+#define SERVER_LOG(s, level, ...) \
+    do { \
+        if (live_config(s)->log_level >= (level)) { \
+            printf(__VA_ARGS__); \
+        } \
+    } while (0)
+
+
+/* Live configuration shared by the master and workers, protected by a
+ * seqlock: seq is odd while it is being written */
+struct uds_config_shared {
+    uint32_t seq;                       /* Sequence of the seqlock */
+    uds_server_config_t config;         /* The live configuration */
+    uds_doorbell_t changed;             /* Rung when the config changed */
+};
+
+/* A copy of live configuration in a process. Readers use the current one
+ * without lock, an update publishes a new one and retires the old one. It
+ * is freed after the requests running are done, like a command table */
+struct uds_config_snapshot {
+    uds_server_config_t config;         /* The live configuration */
+    uint32_t seq;                       /* The sequence it is copied at */
+    uint64_t retire_epoch;              /* Epoch it is retired at */
+    struct uds_config_snapshot *retired;    /* Older snapshot, it may be
+                                               still in use by readers */
+};
+
+/* A sub-request of an envelope being handled */
+struct multi_item {
+    uds_command_t *req;                 /* Points into the envelope */
+    uds_command_t *resp;                /* NULL: the handler failed */
+    int encoded;                        /* 1: resp is a constant response */
+};
+
+/* An envelope being handled, shared by the threads running it */
+struct multi_batch {
+    uds_connect_t *sc;                  /* The connection */
+    struct multi_item *items;           /* The sub-requests */
+    int count;                          /* Count of sub-requests */
+    int next;                           /* The next one to run, atomic */
+    int want;                           /* Helpers it still waits for */
+    int active;                         /* Helpers running it */
+    struct multi_batch *link;           /* Next envelope in the queue */
+};
+
+
+/******************************************************************************
+ * NAME:
+ *      default_alloc
+ *
+ * DESCRIPTION: 
+ *      The default allocator of the library, malloc() and free().
+ *
+ * PARAMETERS:
+ *      ctx   - Not used
+ *      size  - Bytes to allocate
+ *      align - Alignment of the memory
+ *
+ * RETURN:
+ *      The memory, NULL if failed.
+ ******************************************************************************/
+static void *default_alloc(void *ctx, size_t size, size_t align)
+{
+    void *p;
+
+    if (align <= UDS_ALLOC_ALIGN) {
+        return malloc(size);
+    }
+    if (posix_memalign(&p, align, size) != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return p;
+}
+
+static void default_free(void *ctx, void *ptr)
+{
+    free(ptr);
+}
+
+/* The allocator of the library */
+static uds_allocator_t allocator = { default_alloc, default_free, NULL };
+
+/* Circuit breakers of the servers connected by the process */
+static uds_breaker_t breakers[UDS_BREAKER_SLOTS];
+static pthread_mutex_t breakers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Sockets passed in by a service manager, read once from the environment */
+static pthread_once_t listen_once = PTHREAD_ONCE_INIT;
+static int listen_nfds;         /* Count of sockets passed in */
+static int listen_taken;        /* Count of them taken by listeners */
+
+
+/******************************************************************************
+ * NAME:
+ *      uds_set_allocator
+ *
+ * DESCRIPTION: 
+ *      Set the allocator of the library, e.g. an arena. Set it before any
+ *      server or client is created, the memory allocated before is freed
+ *      by the new allocator too.
+ *
+ * PARAMETERS:
+ *      a - The allocator, NULL for malloc() and free()
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void uds_set_allocator(const uds_allocator_t *a)
+{
+    if ((a == NULL) || (a->alloc == NULL) || (a->free == NULL)) {
+        allocator.alloc = default_alloc;
+        allocator.free = default_free;
+        allocator.ctx = NULL;
+    } else {
+        allocator = *a;
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uds_malloc
+ *
+ * DESCRIPTION: 
+ *      Allocate memory by the allocator of the library. Request handlers
+ *      shall allocate their responses by it.
+ *
+ * PARAMETERS:
+ *      size - Bytes to allocate
+ *
+ * RETURN:
+ *      The memory aligned to UDS_ALLOC_ALIGN, NULL if failed.
+ ******************************************************************************/
+void *uds_malloc(size_t size)
+{
+    return allocator.alloc(allocator.ctx, size, UDS_ALLOC_ALIGN);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uds_free
+ *
+ * DESCRIPTION: 
+ *      Free the memory allocated by uds_malloc(), e.g. the responses of
+ *      client_send_request().
+ *
+ * PARAMETERS:
+ *      ptr - The memory, it can be NULL
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void uds_free(void *ptr)
+{
+    if (ptr != NULL) {
+        allocator.free(allocator.ctx, ptr);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      alloc_cache_aligned
+ *
+ * DESCRIPTION: 
+ *      Allocate memory starting on a cache line by the allocator of the
+ *      library, free it by uds_free().
+ *
+ * PARAMETERS:
+ *      size - Bytes to allocate
+ *
+ * RETURN:
+ *      The memory, NULL if failed.
+ ******************************************************************************/
+static void *alloc_cache_aligned(size_t size)
+{
+    return allocator.alloc(allocator.ctx, size, UDS_CACHE_LINE);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      now_ns
+ *
+ * DESCRIPTION: 
+ *      Get the time of monotonic clock.
+ *
+ * PARAMETERS:
+ *      None
+ *
+ * RETURN:
+ *      The time in nanoseconds.
+ ******************************************************************************/
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
 
 /******************************************************************************
  * NAME:
- *      recv_data
+ *      recv_full
  *
  * DESCRIPTION: 
- *      Read data from socket fd.
+ *      Read exactly len bytes from a stream socket.
  *
  * PARAMETERS:
  *      sockfd - The socket fd
  *      buf    - The buffer to keep data
- *      len    - The length of buffer
- *      flags  - Flags pass to recv() function
+ *      len    - The length of data to read
  *
  * RETURN:
- *      Bytes received.
+ *      Bytes received, less than len if the peer closed or error.
  ******************************************************************************/
-static ssize_t recv_data(int sockfd, char *buf, ssize_t len, int flags)
+static ssize_t recv_full(int sockfd, char *buf, ssize_t len)
 {
     ssize_t bytes;
-    ssize_t pos;
-    int count;
-    fd_set readfds, writefds;
-    struct timeval timeout;
-
+    ssize_t pos = 0;
 
-    pos = 0;
-    do {
-        bytes = recv(sockfd, buf+pos, len-pos, flags);
+    while (pos < len) {
+        bytes = recv(sockfd, buf+pos, len-pos, MSG_WAITALL);
         if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             perror("recv error");
             break;
         } else if (bytes == 0) {
-            /* No data left, jump out */
-            break;
-        } else {
-            pos += bytes;
-            if (pos >= len) {
-                /* The buffer is full, jump out */
-                break;
-            }
-        }
-
-        /*
-         * Check if data is available from socket fd, count is 0 when no data
-         * available. Make select wait up to 10 ms for incoming data.
-         * NOTES: On Linux, select() modifies timeout to reflect the amount of time
-         * not slept.
-         */
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        FD_SET(sockfd, &readfds);
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 10*1000;
-        count = select(sockfd + 1, &readfds, &writefds, (fd_set *)0, &timeout);
-        if (count <= 0)  {
+            /* Closed by peer */
             break;
         }
-    } while (count > 0);
+        pos += bytes;
+    }
 
     return pos;
 }
 
 
-#if 0
-
 /******************************************************************************
  * NAME:
  *      recv_packet
@@ -100,115 +305,100 @@ static ssize_t recv_data(int sockfd, char *buf, ssize_t len, int flags)
  *        (2) Check the signature of packet
  *        (3) Get the data length of packet
  *        (4) Receive the data of packet
+ *      A "SOCK_SEQPACKET" socket receives the whole packet in one call.
  *
  * PARAMETERS:
- *      sockfd - The socket fd
- *      buf    - The buffer to keep command packet
- *      len    - The length of buffer
- *      flags  - Flags pass to recv() function
+ *      sockfd    - The socket fd
+ *      buf       - The buffer to keep command packet
+ *      len       - The length of buffer
+ *      seqpacket - 1: it is a "SOCK_SEQPACKET" socket
  *
  * RETURN:
- *      Bytes received.
+ *      Bytes received. 0 if the peer closed, -1 if error and the stream
+ *      can't be used any more.
  ******************************************************************************/
-static ssize_t recv_packet(int sockfd, char *buf, ssize_t len, int flags)
+static ssize_t recv_packet(int sockfd, char *buf, ssize_t len, int seqpacket)
 {
-    ssize_t bytes;
-    ssize_t pos;
-    int count;
-    fd_set readfds, writefds;
-    struct timeval timeout;
     uds_command_t *pkt = (uds_command_t *)buf;
     ssize_t header_len = sizeof(uds_command_t);
+    ssize_t pos, total;
 
-    FD_ZERO(&readfds);
-    FD_ZERO(&writefds);
-    FD_SET(sockfd, &readfds);
-
-    /* Receive the header of command packet first */
-    pos = 0;
-    while (pos < header_len) {
-        bytes = recv(sockfd, buf+pos, header_len-pos, flags);
-        if (bytes < 0) {
+    if (seqpacket) {
+        do {
+            pos = recv(sockfd, buf, len, 0);
+        } while ((pos < 0) && (errno == EINTR));
+        if (pos < 0) {
             perror("recv error");
-            return 0;
-        } else if (bytes == 0) {
-            /* No data left, jump out */
-            return pos;
-        } else {
-            pos += bytes;
-            if (pos >= header_len) {
-                /* All data of header received, jump out */
-                break;
-            }
         }
+        return pos;
+    }
 
-        /*
-         * Check if data is available from socket fd, count is 0 when no data
-         * available.
-         * Make select wait up to 10 ms for incoming data.
-         * NOTES: On Linux, select() modifies timeout to reflect the amount of time
-         * not slept.
-         */
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        FD_SET(sockfd, &readfds);
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 10*1000;
-        count = select(sockfd + 1, &readfds, &writefds, (fd_set *)0, &timeout);
-        if (count <= 0)  {
-            break;
-        }
-    } 
+    /* Receive the header of command packet first */
+    pos = recv_full(sockfd, buf, header_len);
+    if (pos < header_len) {
+        return (pos == 0) ? 0 : -1;
+    }
 
     /* Check the signature of command packet */
     if (pkt->signature != UDS_SIGNATURE) {
-        printf("Error: invalid signature of packet\n");
-        return 0;
+        printf("Error: invalid signature of packet (0x%08X)\n", pkt->signature);
+        return -1;
     }
 
     /* Get the total length of command packet */
-    if (len > pkt->data_len + header_len) {
-        len = pkt->data_len + header_len;
+    total = header_len + pkt->data_len;
+    if ((pkt->data_len > (uint32_t)len) || (total > len)) {
+        printf("Error: packet too large (%u bytes)\n", pkt->data_len);
+        return -1;
     }
 
     /* Receive all data of command packet */
-    while (pos < len) {
-        bytes = recv(sockfd, buf+pos, len-pos, flags);
-        if (bytes < 0) {
-            perror("recv error");
-            break;
-        } else if (bytes == 0) {
-            /* No data left, jump out */
-            break;
-        } else {
-            pos += bytes;
-            if (pos >= len) {
-                /* All data received, jump out */
-                break;
-            }
-        }
+    if (recv_full(sockfd, buf + pos, total - pos) != total - pos) {
+        return -1;
+    }
 
-        /*
-         * Check if data is available from socket fd, count is 0 when no data
-         * available.
-         * Make select wait up to 10 ms for incoming data.
-         * NOTES: On Linux, select() modifies timeout to reflect the amount of time
-         * not slept
-         */
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        FD_SET(sockfd, &readfds);
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 10*1000;
-        count = select(sockfd + 1, &readfds, &writefds, (fd_set *)0, &timeout);
-        if (count <= 0)  {
-            break;
+    return total;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      busy_poll
+ *
+ * DESCRIPTION: 
+ *      Spin on non-blocking recv() for up to spin_us microseconds, waiting
+ *      for data from socket. It saves the sleep/wakeup of a blocking recv()
+ *      when the data arrives soon, at the cost of CPU time.
+ *
+ * PARAMETERS:
+ *      sockfd  - The socket fd
+ *      spin_us - The max time to spin(us)
+ *      spent   - Return the time spent in spinning(ns)
+ *
+ * RETURN:
+ *      1 - Data (or EOF/error) is ready, 0 - Not ready, shall block
+ ******************************************************************************/
+static int busy_poll(int sockfd, int spin_us, int64_t *spent)
+{
+    int64_t start, now, deadline;
+    ssize_t bytes;
+    char c;
+
+    start = now_ns();
+    deadline = start + spin_us * 1000LL;
+    do {
+        bytes = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        now = now_ns();
+        if ((bytes >= 0) || ((errno != EAGAIN) &&
+                (errno != EWOULDBLOCK) && (errno != EINTR))) {
+            *spent = now - start;
+            return 1;
         }
-    }
+    } while (now < deadline);
 
-    return pos;
+    *spent = now - start;
+    return 0;
 }
-#endif
 
 
 /******************************************************************************
@@ -303,245 +493,3338 @@ static int verify_command_packet(void *buf, size_t len)
 
 /******************************************************************************
  * NAME:
- *      request_handle_routine
+ *      multi_iter_init
  *
  * DESCRIPTION: 
- *      A thread function to receive the request from client,
- *      handle the request and send response back to client.
+ *      Validate an envelope (UDS_CMD_MULTI request or its response), and
+ *      start to iterate its sub-packets. The sub-packets shall fill the
+ *      payload exactly, so multi_iter_next() doesn't check any more.
  *
  * PARAMETERS:
- *      arg - A pointer of connection info
+ *      it  - Return the iterator
+ *      pkt - The envelope, it shall be verified already
  *
  * RETURN:
- *      None
+ *      0 - OK, Others - Error
  ******************************************************************************/
-static void *request_handle_routine(void *arg)
+int multi_iter_init(uds_multi_iter_t *it, const uds_command_t *pkt)
 {
-    uds_connect_t *sc = (uds_connect_t *)arg;
-    uds_command_t *req;
-    uds_command_t *resp;
-    uint8_t buf[UDS_BUF_SIZE];
-    ssize_t bytes, req_len, resp_len;
+    const uint8_t *p = (const uint8_t *)(pkt + 1);
+    uds_multi_header_t hdr;
+    uds_command_t sub;
+    uint32_t left = pkt->data_len;
+    unsigned int i;
 
-    if (sc == NULL) {
-        printf("Error: invalid argument of thread routine\n");
-        pthread_exit(0);
+    if (left < sizeof(hdr)) {
+        return -1;
     }
+    memcpy(&hdr, p, sizeof(hdr));
+    p += sizeof(hdr);
+    left -= sizeof(hdr);
 
-    while (1) {
-        /* Receive request from client */
-        //req_len = recv(sc->client_fd, buf, sizeof(buf), 0);
-        req_len = recv_data(sc->client_fd, (char *)buf, sizeof(buf), 0);
-        if (req_len <= 0) {
-            close(sc->client_fd);
-            sc->inuse = 0;
-            break;
-        }
-
-        /* Check the integrity of the request packet */
-        if (!verify_command_packet(buf, req_len)) {
-            /* Discard invaid packet */
-            continue;
-        }
-
-        /* Process the request */
-        req = (uds_command_t *)buf;
-        resp = sc->serv->request_handler(req);
-        if (resp == NULL) {
-            resp = (uds_command_t *)buf;   /* Use a local buffer */
-            resp->status = STATUS_ERROR;
-            resp->data_len = 0;
-        }
-
-        resp_len = sizeof(uds_command_t) + resp->data_len;
-        resp->signature = req->signature;
-        resp->checksum = 0;
-        resp->checksum = compute_checksum(resp, resp_len);
+    it->next = p;
+    it->left = hdr.count;
+    it->flags = hdr.flags;
 
-        /* Send response */
-        bytes = send(sc->client_fd, resp, resp_len, MSG_NOSIGNAL);
-        if (resp != (uds_command_t *)buf) {    /* If NOT local buffer, free it */
-            free(resp);
+    for (i = 0; i < hdr.count; i++) {
+        if (left < sizeof(sub)) {
+            return -1;
         }
-        if (bytes != resp_len) {
-            printf("Error: send response error\n");
-            close(sc->client_fd);
-            sc->inuse = 0;
-            break;
+        memcpy(&sub, p, sizeof(sub));
+        if (sub.data_len > left - sizeof(sub)) {
+            return -1;
         }
+        p += sizeof(sub) + sub.data_len;
+        left -= sizeof(sub) + sub.data_len;
     }
 
-    pthread_exit(0);
+    return (left == 0) ? 0 : -1;
 }
 
 
 /******************************************************************************
  * NAME:
- *      server_init
+ *      multi_iter_next
  *
  * DESCRIPTION: 
- *      Do some initialzation work for server.
+ *      Get the next sub-packet of an envelope, pointing into the envelope.
  *
  * PARAMETERS:
- *      sock_path - The path of unix domain socket
- *      req_handler - The function pointer of a user-defined request handler.
+ *      it - The iterator
  *
  * RETURN:
- *      A pointer of server info.
+ *      The sub-packet, NULL if no more.
  ******************************************************************************/
-uds_server_t *server_init(const char *sock_path, request_handler_t req_handler)
+const uds_command_t *multi_iter_next(uds_multi_iter_t *it)
 {
-    uds_server_t *s;
-    struct sockaddr_un addr;
-    int i, rc;
-
-    if (req_handler == NULL) {
-        printf("Error: invalid parameter!\n");
-        return NULL;
-    }
-
-    s = (uds_server_t *)malloc(sizeof(uds_server_t));
-    if (s == NULL) {
-        perror("malloc error");
-        return NULL;
-    }
-    memset(s, 0, sizeof(uds_server_t));
-    for (i = 0; i < UDS_MAX_CLIENT; i++) {
-        s->conn[i].serv = s;
-    }
+    const uds_command_t *sub;
 
-    /* Setup request handler */
-    s->request_handler = req_handler;
-
-    unlink(sock_path);
-
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strcpy(addr.sun_path, sock_path);
-
-    s->sockfd = socket(AF_UNIX, UDS_SOCK_TYPE, 0);
-    if (s->sockfd < 0) {
-        perror("socket error");
-        free(s);
-        return NULL;
-    }
-
-    /* Avoid "Address already in use" error in bind() */
-    //int val = 1;
-    //if (setsockopt(s->sockfd, SOL_SOCKET, SO_REUSEADDR, &val,
-    //        sizeof(val)) == -1) {
-    //    perror("setsockopt error");
-    //    return NULL;
-    //}
-
-    rc = bind(s->sockfd, (struct sockaddr *) &addr, sizeof(addr));
-    if (rc != 0) {
-        perror("bind error");
-        close(s->sockfd);
-        free(s);
-        return NULL;
-    }
-
-    rc = listen(s->sockfd, UDS_MAX_BACKLOG);
-    if (rc != 0) {
-        perror("listen error");
-        close(s->sockfd);
-        free(s);
+    if (it->left == 0) {
         return NULL;
     }
+    sub = (const uds_command_t *)it->next;
+    it->next += sizeof(uds_command_t) + sub->data_len;
+    it->left--;
 
-    return s;
+    return sub;
 }
 
 
 /******************************************************************************
  * NAME:
- *      server_accept_request
+ *      command_barrier
  *
  * DESCRIPTION: 
- *      Accept a request from client and start a new thread to process it.
+ *      Make the epochs stored by the connection threads visible to an
+ *      update, after it has published a new table or configuration
+ *      snapshot. With membarrier() the
+ *      readers don't run a barrier themselves.
  *
  * PARAMETERS:
  *      s - A pointer of server info
  *
  * RETURN:
- *      0 - OK, Others - Error
+ *      None
  ******************************************************************************/
-int server_accept_request(uds_server_t *s)
+static void command_barrier(uds_server_t *s)
 {
-    uds_connect_t *sc;
-    int cl, i;
+    if (s->membarrier) {
+        if (syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) ==
+                0) {
+            return;
+        }
 
-    if (s == NULL) {
-        printf("Error: invalid parameter!\n");
+        /* The registration is lost by a forked worker, redo it */
+        if ((syscall(SYS_membarrier,
+                MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) &&
+                (syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED,
+                    0) == 0)) {
+            return;
+        }
+        perror("membarrier error");
+        s->membarrier = 0;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      epoch_oldest
+ *
+ * DESCRIPTION: 
+ *      Find the oldest epoch of requests running, after the caller has
+ *      published a new table or snapshot and retired the old one. What is
+ *      retired at an epoch no older than it can be freed.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      The oldest epoch of requests running, 0 if none.
+ ******************************************************************************/
+static uint64_t epoch_oldest(uds_server_t *s)
+{
+    uint64_t oldest, e;
+    int i;
+
+    command_barrier(s);
+    oldest = 0;
+    for (i = 0; i < s->config.max_client; i++) {
+        e = __atomic_load_n(&s->readers[i].epoch, __ATOMIC_ACQUIRE);
+        if ((e != 0) && ((oldest == 0) || (e < oldest))) {
+            oldest = e;
+        }
+    }
+
+    return oldest;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      refresh_config
+ *
+ * DESCRIPTION: 
+ *      Copy the shared live configuration to a new snapshot and publish it
+ *      to the readers of this process. The old snapshot is retired, and
+ *      the retired ones no request can use are freed. Called with
+ *      config_lock held.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      The current snapshot.
+ ******************************************************************************/
+static struct uds_config_snapshot *refresh_config(uds_server_t *s)
+{
+    struct uds_config_shared *sh = s->shared_config;
+    struct uds_config_snapshot *old, *snap, **pt;
+    uint64_t oldest;
+    uint32_t seq;
+
+    old = s->live_config;
+    if (old->seq == __atomic_load_n(&sh->seq, __ATOMIC_ACQUIRE)) {
+        /* Refreshed by another thread */
+        return old;
+    }
+
+    snap = (struct uds_config_snapshot *)uds_malloc(sizeof(*snap));
+    if (snap == NULL) {
+        perror("malloc error");
+        return old;
+    }
+
+    /* Read the seqlock, retry if a writer is in progress */
+    for (;;) {
+        seq = __atomic_load_n(&sh->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(&snap->config, &sh->config, sizeof(snap->config));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&sh->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+    snap->seq = seq;
+    snap->retire_epoch = 0;
+    snap->retired = old;
+
+    __atomic_store_n(&s->live_config, snap, __ATOMIC_RELEASE);
+    old->retire_epoch = __atomic_add_fetch(&s->epoch, 1, __ATOMIC_SEQ_CST);
+
+    /* Free the retired snapshots older than any request running */
+    oldest = epoch_oldest(s);
+    pt = &snap->retired;
+    while ((old = *pt) != NULL) {
+        if ((oldest == 0) || (oldest >= old->retire_epoch)) {
+            *pt = old->retired;
+            uds_free(old);
+        } else {
+            pt = &old->retired;
+        }
+    }
+
+    return snap;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      live_config
+ *
+ * DESCRIPTION: 
+ *      Get the live configuration of server. It costs two atomic loads if
+ *      the configuration isn't changed. Only a connection thread can call
+ *      it, between epoch_enter() and epoch_leave(), and use it until then.
+ *      Other threads call config_copy().
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      The live configuration.
+ ******************************************************************************/
+static const uds_server_config_t *live_config(uds_server_t *s)
+{
+    struct uds_config_snapshot *snap;
+
+    snap = __atomic_load_n(&s->live_config, __ATOMIC_ACQUIRE);
+    if (snap->seq != __atomic_load_n(&s->shared_config->seq,
+            __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&s->config_lock);
+        snap = refresh_config(s);
+        pthread_mutex_unlock(&s->config_lock);
+    }
+
+    return &snap->config;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      config_copy
+ *
+ * DESCRIPTION: 
+ *      Copy the live configuration of server, by any thread.
+ *
+ * PARAMETERS:
+ *      s   - A pointer of server info
+ *      cfg - Return the live configuration
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void config_copy(uds_server_t *s, uds_server_config_t *cfg)
+{
+    pthread_mutex_lock(&s->config_lock);
+    *cfg = refresh_config(s)->config;
+    pthread_mutex_unlock(&s->config_lock);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_reconfigure
+ *
+ * DESCRIPTION: 
+ *      Change the live configuration of a running server, by "key = value"
+ *      lines in a string. Only the items marked as live can be changed:
+ *      max_client, workers, recv_timeout, sndbuf, rcvbuf, log_level and
+ *      slow_request_ms. All processes of the server see the change.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      text - The lines of configuration
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_reconfigure(uds_server_t *s, const char *text)
+{
+    struct uds_config_shared *sh;
+    uds_server_config_t cfg;
+    uint32_t seq;
+    int rc, min_workers;
+
+    if ((s == NULL) || (text == NULL)) {
+        printf("Error: invalid parameter!\n");
+        return -1;
+    }
+    sh = s->shared_config;
+
+    /* Lock the seqlock by making the sequence odd */
+    seq = __atomic_load_n(&sh->seq, __ATOMIC_RELAXED);
+    while ((seq & 1) || !__atomic_compare_exchange_n(&sh->seq, &seq, seq + 1,
+            0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        sched_yield();
+        seq = __atomic_load_n(&sh->seq, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    cfg = sh->config;
+    rc = server_config_update(&cfg, text, 1);
+    min_workers = (s->config.engine == UDS_ENGINE_PREFORK) ? 1 : 0;
+    if ((rc == 0) && ((cfg.max_client <= 0) ||
+            (cfg.max_client > s->config.max_client) ||
+            (cfg.workers < min_workers) || (cfg.workers > UDS_MAX_WORKER))) {
+        printf("Error: max_client shall be 1~%d, workers shall be %d~%d\n",
+            s->config.max_client, min_workers, UDS_MAX_WORKER);
+        rc = -1;
+    }
+
+    if (rc == 0) {
+        sh->config = cfg;
+        __atomic_store_n(&sh->seq, seq + 2, __ATOMIC_RELEASE);
+        config_copy(s, &cfg);
+        doorbell_ring(&sh->changed);
+
+        /* Let the waiting requests check the new limit */
+        pthread_mutex_lock(&s->admission.lock);
+        pthread_cond_broadcast(&s->admission.cond);
+        pthread_mutex_unlock(&s->admission.lock);
+    } else {
+        /* Nothing changed */
+        __atomic_store_n(&sh->seq, seq, __ATOMIC_RELEASE);
+    }
+
+    return rc;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_publish_snapshot
+ *
+ * DESCRIPTION: 
+ *      Publish a new version of the read-mostly data (version, routing table
+ *      and so on) to the clients which mapped the snapshot. They read it
+ *      with plain loads, no request is needed. It can be called by any
+ *      thread or worker process, the writers are serialized.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      data - The data
+ *      len  - Length of the data, no more than snapshot_size
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_publish_snapshot(uds_server_t *s, const void *data, size_t len)
+{
+    if ((s == NULL) || ((data == NULL) && (len > 0))) {
+        printf("Error: invalid parameter!\n");
+        return -1;
+    }
+    if (s->snapshot_fd < 0) {
+        printf("Error: snapshot is disabled (snapshot_size = 0)\n");
+        return -1;
+    }
+
+    return snapshot_publish(s->snapshot, data, len);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      admin_handle
+ *
+ * DESCRIPTION: 
+ *      Handle the commands for administration, which are accepted on admin
+ *      listeners only.
+ *
+ * PARAMETERS:
+ *      s   - A pointer of server info
+ *      req - The request
+ *
+ * RETURN:
+ *      The response, NULL if it isn't a command for administration.
+ ******************************************************************************/
+static uds_command_t *admin_handle(uds_server_t *s, uds_command_t *req)
+{
+    uds_command_t *resp;
+    char *text;
+    size_t len;
+
+    switch (req->command) {
+    case UDS_CMD_SET_CONFIG:
+        resp = (uds_command_t *)uds_malloc(sizeof(uds_command_t));
+        text = (char *)uds_malloc(req->data_len + 1);
+        if ((resp == NULL) || (text == NULL)) {
+            perror("malloc error");
+            uds_free(text);
+            uds_free(resp);
+            return NULL;
+        }
+        memcpy(text, req + 1, req->data_len);
+        text[req->data_len] = '\0';
+
+        resp->status = (server_reconfigure(s, text) == 0) ?
+            STATUS_SUCCESS : STATUS_ERROR;
+        resp->data_len = 0;
+        uds_free(text);
+        return resp;
+
+    case UDS_CMD_GET_CONFIG:
+        len = s->config.buf_size;
+        resp = (uds_command_t *)uds_malloc(sizeof(uds_command_t) + len);
+        if (resp == NULL) {
+            perror("malloc error");
+            return NULL;
+        }
+        resp->status = STATUS_SUCCESS;
+        resp->data_len = server_config_dump(live_config(s), (char *)(resp + 1),
+            len);
+        return resp;
+
+    default:
+        return NULL;
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      isqrt
+ *
+ * DESCRIPTION: 
+ *      Integer square root.
+ *
+ * PARAMETERS:
+ *      n - The number
+ *
+ * RETURN:
+ *      The largest integer whose square isn't greater than n.
+ ******************************************************************************/
+static uint32_t isqrt(uint32_t n)
+{
+    uint32_t x = n, y = (n + 1) / 2;
+
+    while (y < x) {
+        x = y;
+        y = (x + n / x) / 2;
+    }
+
+    return x;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      admission_enter
+ *
+ * DESCRIPTION: 
+ *      Admission control before handling a request. When max_inflight
+ *      requests are being handled, the request waits in queue. It is
+ *      rejected at once if the queue is full, or the queue delay has been
+ *      above the target for an interval (like CoDel, the rejection rate goes
+ *      up until the delay drops below the target).
+ *
+ * PARAMETERS:
+ *      s   - A pointer of server info
+ *      cfg - The live configuration
+ *
+ * RETURN:
+ *      1 - Admitted, call admission_leave() when done; 0 - Rejected
+ ******************************************************************************/
+static int admission_enter(uds_server_t *s, const uds_server_config_t *cfg)
+{
+    uds_admission_t *ad = &s->admission;
+    int64_t start, now, target, interval;
+
+    if (cfg->max_inflight <= 0) {
+        return 1;
+    }
+    target = cfg->queue_target_ms * 1000000LL;
+    interval = cfg->queue_interval_ms * 1000000LL;
+
+    start = now_ns();
+    pthread_mutex_lock(&ad->lock);
+
+    /* No queue, handle it at once */
+    if ((ad->waiting == 0) && (ad->inflight < cfg->max_inflight)) {
+        ad->inflight++;
+        ad->first_above = 0;
+        ad->dropping = 0;
+        pthread_mutex_unlock(&ad->lock);
+        return 1;
+    }
+
+    if ((cfg->queue_limit > 0) && (ad->waiting >= cfg->queue_limit)) {
+        pthread_mutex_unlock(&ad->lock);
+        return 0;
+    }
+    if (ad->dropping && (start >= ad->drop_next)) {
+        ad->drop_count++;
+        ad->drop_next = start + interval / isqrt(ad->drop_count);
+        pthread_mutex_unlock(&ad->lock);
+        return 0;
+    }
+
+    ad->waiting++;
+    while ((live_config(s)->max_inflight > 0) &&
+            (ad->inflight >= live_config(s)->max_inflight)) {
+        pthread_cond_wait(&ad->cond, &ad->lock);
+    }
+    ad->waiting--;
+    ad->inflight++;
+
+    /* Track how long the queue delay stays above target */
+    now = now_ns();
+    if (now - start < target) {
+        ad->first_above = 0;
+        ad->dropping = 0;
+    } else if (ad->first_above == 0) {
+        ad->first_above = now + interval;
+    } else if (!ad->dropping && (now >= ad->first_above)) {
+        ad->dropping = 1;
+        ad->drop_count = 1;
+        ad->drop_next = now;
+    }
+
+    pthread_mutex_unlock(&ad->lock);
+    return 1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      admission_leave
+ *
+ * DESCRIPTION: 
+ *      Wake up a request waiting in queue after a request is handled.
+ *
+ * PARAMETERS:
+ *      s   - A pointer of server info
+ *      cfg - The live configuration used by admission_enter()
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void admission_leave(uds_server_t *s, const uds_server_config_t *cfg)
+{
+    uds_admission_t *ad = &s->admission;
+
+    if (cfg->max_inflight <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&ad->lock);
+    ad->inflight--;
+    if (ad->waiting > 0) {
+        pthread_cond_signal(&ad->cond);
+    }
+    pthread_mutex_unlock(&ad->lock);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      rate_bucket_join
+ *
+ * DESCRIPTION: 
+ *      Count a connection in a bucket if it is free, or owned by the peer.
+ *
+ * PARAMETERS:
+ *      b     - The bucket
+ *      key   - The uid/pid of peer + 1
+ *      share - 1: join the bucket of another peer too
+ *
+ * RETURN:
+ *      1 - Joined, 0 - Owned by another peer
+ ******************************************************************************/
+static int rate_bucket_join(uds_rate_bucket_t *b, uint32_t key, int share)
+{
+    uint64_t owner;
+
+    owner = __atomic_load_n(&b->owner, __ATOMIC_ACQUIRE);
+    for (;;) {
+        if (owner == 0) {
+            if (__atomic_compare_exchange_n(&b->owner, &owner,
+                    ((uint64_t)key << 32) | 1, 0, __ATOMIC_ACQ_REL,
+                    __ATOMIC_ACQUIRE)) {
+                /* Don't charge the peer for the previous owner */
+                __atomic_store_n(&b->tat, 0, __ATOMIC_RELAXED);
+                return 1;
+            }
+        } else if (share || ((uint32_t)(owner >> 32) == key)) {
+            if (__atomic_compare_exchange_n(&b->owner, &owner, owner + 1, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return 1;
+            }
+        } else {
+            return 0;
+        }
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      rate_bucket_get
+ *
+ * DESCRIPTION: 
+ *      Find the rate limiting bucket of a peer, or claim a free one, and
+ *      count the connection in it. If no bucket can be found in a few
+ *      probes, the peer shares the bucket at its hash position with others.
+ *
+ * PARAMETERS:
+ *      s   - A pointer of server info
+ *      key - The uid/pid of peer
+ *
+ * RETURN:
+ *      The bucket of peer, release it by rate_bucket_put().
+ ******************************************************************************/
+static uds_rate_bucket_t *rate_bucket_get(uds_server_t *s, uint32_t key)
+{
+    uds_rate_bucket_t *b;
+    uint32_t hash, i;
+
+    key++;      /* 0 is for free bucket */
+    hash = key * 2654435761U;
+    for (i = 0; i < UDS_RATE_PROBES; i++) {
+        b = &s->rate_buckets[(hash + i) & (UDS_RATE_BUCKETS - 1)];
+        if (rate_bucket_join(b, key, 0)) {
+            return b;
+        }
+    }
+
+    b = &s->rate_buckets[hash & (UDS_RATE_BUCKETS - 1)];
+    rate_bucket_join(b, key, 1);
+    return b;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      rate_bucket_put
+ *
+ * DESCRIPTION: 
+ *      Release the bucket of a connection, it is freed if no connection uses
+ *      it any more.
+ *
+ * PARAMETERS:
+ *      b - The bucket, NULL is ignored
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void rate_bucket_put(uds_rate_bucket_t *b)
+{
+    uint64_t owner, left;
+
+    if (b == NULL) {
+        return;
+    }
+    owner = __atomic_load_n(&b->owner, __ATOMIC_ACQUIRE);
+    do {
+        left = ((owner & 0xFFFFFFFF) > 1) ? owner - 1 : 0;
+    } while (!__atomic_compare_exchange_n(&b->owner, &owner, left, 1,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      rate_limit_check
+ *
+ * DESCRIPTION: 
+ *      Check the rate limit of a peer with GCRA: each request pushes the
+ *      theoretical arrival time forward by 1/rate, the request is rejected
+ *      if it is ahead of now by more than a burst. Lock-free.
+ *
+ * PARAMETERS:
+ *      b    - The bucket of peer
+ *      cfg  - The live configuration
+ *      cost - The count of requests, no more than the burst is charged
+ *
+ * RETURN:
+ *      1 - Allowed, 0 - Over the limit
+ ******************************************************************************/
+static int rate_limit_check(uds_rate_bucket_t *b,
+    const uds_server_config_t *cfg, uint32_t cost)
+{
+    int64_t now, tat, new_tat, period, burst;
+
+    if ((cfg->rate_limit <= 0) || (b == NULL)) {
+        return 1;
+    }
+    period = 1000000000LL / cfg->rate_limit;
+    burst = period * ((cfg->rate_burst > 0) ? cfg->rate_burst : 1);
+
+    /* An envelope larger than the burst is charged the burst, or it would
+     * be rejected forever */
+    if (period * cost > burst) {
+        cost = (uint32_t)(burst / period);
+    }
+
+    now = now_ns();
+    tat = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+    do {
+        new_tat = ((tat > now) ? tat : now) + period * cost;
+        if (new_tat - now > burst) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&b->tat, &tat, new_tat, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return 1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      epoch_enter
+ *
+ * DESCRIPTION: 
+ *      Start a request on a connection: the command table it loads is not
+ *      freed until epoch_leave(). It costs a store to the line of the
+ *      connection, the barrier is run by the updates if membarrier() works.
+ *
+ * PARAMETERS:
+ *      sc - A pointer of connection info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void epoch_enter(uds_connect_t *sc)
+{
+    uds_server_t *s = sc->serv;
+
+    __atomic_store_n(&s->readers[sc - s->conn].epoch,
+        __atomic_load_n(&s->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+
+    /* Either the update sees this reader, or the reader sees the new
+     * table */
+    if (s->membarrier) {
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    } else {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      epoch_leave
+ *
+ * DESCRIPTION: 
+ *      End a request on a connection, it uses the command table no more.
+ *
+ * PARAMETERS:
+ *      sc - A pointer of connection info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void epoch_leave(uds_connect_t *sc)
+{
+    uds_server_t *s = sc->serv;
+
+    __atomic_store_n(&s->readers[sc - s->conn].epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      command_lookup
+ *
+ * DESCRIPTION: 
+ *      Find a command in the current command table, between epoch_enter()
+ *      and epoch_leave(). Lock-free.
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      command - The command of request
+ *
+ * RETURN:
+ *      The entry, NULL if the command is not in the table.
+ ******************************************************************************/
+static const uds_command_entry_t *command_lookup(uds_server_t *s,
+    uint32_t command)
+{
+    const uds_command_table_t *t;
+    int lo, hi, mid;
+
+    t = __atomic_load_n(&s->commands, __ATOMIC_ACQUIRE);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    lo = 0;
+    hi = t->count - 1;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (t->entries[mid].command == command) {
+            return &t->entries[mid];
+        } else if (t->entries[mid].command < command) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      call_handler
+ *
+ * DESCRIPTION: 
+ *      Pass a request to the handler of its command, or to the request
+ *      handler of server.
+ *
+ * PARAMETERS:
+ *      s     - A pointer of server info
+ *      entry - The entry of command, NULL if it has none
+ *      req   - The request
+ *
+ * RETURN:
+ *      The response, NULL if the handler fails.
+ ******************************************************************************/
+static uds_command_t *call_handler(uds_server_t *s,
+    const uds_command_entry_t *entry, uds_command_t *req)
+{
+    if ((entry != NULL) && (entry->handler != NULL)) {
+        return entry->handler(entry->ctx, req);
+    } else if (s->handler_ctx_fn != NULL) {
+        return s->handler_ctx_fn(s->handler_ctx, req);
+    } else if (s->request_handler != NULL) {
+        return s->request_handler(req);
+    }
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      multi_run
+ *
+ * DESCRIPTION: 
+ *      Run the sub-requests of an envelope until none is left. Threads of a
+ *      parallel envelope run it at the same time, each takes the next
+ *      sub-request.
+ *
+ * PARAMETERS:
+ *      arg - The envelope being handled
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void *multi_run(void *arg)
+{
+    struct multi_batch *b = (struct multi_batch *)arg;
+    uds_server_t *s = b->sc->serv;
+    const uds_command_entry_t *entry;
+    struct multi_item *item;
+    int i;
+
+    /* Run in the epoch of the connection thread, which waits for it */
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) <
+            b->count) {
+        item = &b->items[i];
+        entry = command_lookup(s, item->req->command);
+        if ((entry != NULL) && (entry->wire != NULL)) {
+            item->resp = (uds_command_t *)entry->wire;
+            item->encoded = 1;
+            continue;
+        }
+        if (b->sc->listener->attr.admin) {
+            item->resp = admin_handle(s, item->req);
+        }
+        if ((item->resp == NULL) && (item->req->command != UDS_CMD_MULTI)) {
+            item->resp = call_handler(s, entry, item->req);
+        }
+    }
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      multi_helper
+ *
+ * DESCRIPTION: 
+ *      The routine of a helper thread of parallel envelopes. It joins the
+ *      envelope at the head of queue until the pool is stopped.
+ *
+ * PARAMETERS:
+ *      arg - A pointer of server info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void *multi_helper(void *arg)
+{
+    uds_multi_pool_t *pool = &((uds_server_t *)arg)->multi_pool;
+    struct multi_batch *b;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop) {
+        b = pool->queue;
+        if (b == NULL) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+
+        /* Dequeue the envelope once it has all helpers it wants */
+        b->active++;
+        if (--b->want == 0) {
+            pool->queue = b->link;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        multi_run(b);
+        pthread_mutex_lock(&pool->lock);
+        if (--b->active == 0) {
+            pthread_cond_broadcast(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      multi_pool_grow
+ *
+ * DESCRIPTION: 
+ *      Start helper threads of parallel envelopes until there are nthread.
+ *      The lock of pool shall be held.
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      nthread - Count of helper threads wanted
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void multi_pool_grow(uds_server_t *s, int nthread)
+{
+    uds_multi_pool_t *pool = &s->multi_pool;
+    pthread_attr_t attr;
+
+    if (pool->nthread >= nthread) {
+        return;
+    }
+    pthread_attr_init(&attr);
+    if (s->config.stack_size > 0) {
+        pthread_attr_setstacksize(&attr, s->config.stack_size);
+    }
+    while (pool->nthread < nthread) {
+        if (pthread_create(&pool->tid[pool->nthread], &attr, multi_helper,
+                s) != 0) {
+            perror("pthread_create error");
+            break;
+        }
+        pool->nthread++;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      multi_pool_stop
+ *
+ * DESCRIPTION: 
+ *      Stop the helper threads of parallel envelopes and wait for them.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void multi_pool_stop(uds_server_t *s)
+{
+    uds_multi_pool_t *pool = &s->multi_pool;
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthread; i++) {
+        pthread_join(pool->tid[i], NULL);
+    }
+    pool->nthread = 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      dispatch_multi
+ *
+ * DESCRIPTION: 
+ *      Handle the sub-requests of an envelope, in order or with up to
+ *      multi_threads - 1 helpers from the pool if it is flagged parallel,
+ *      and pack the sub-responses in one response. An envelope can't be
+ *      nested.
+ *
+ * PARAMETERS:
+ *      sc  - A pointer of connection info
+ *      cfg - The live configuration
+ *      it  - The iterator of the validated envelope
+ *
+ * RETURN:
+ *      The response, NULL if no memory.
+ ******************************************************************************/
+static uds_command_t *dispatch_multi(uds_connect_t *sc,
+    const uds_server_config_t *cfg, uds_multi_iter_t *it)
+{
+    uds_multi_pool_t *pool = &sc->serv->multi_pool;
+    struct multi_batch b, **pp;
+    uds_multi_header_t hdr;
+    uds_command_t *resp, *sub;
+    size_t len;
+    uint8_t *p;
+    int i, nthread;
+
+    memset(&b, 0, sizeof(b));
+    b.sc = sc;
+    b.count = it->left;
+    b.items = (struct multi_item *)uds_malloc(
+        (b.count + 1) * sizeof(struct multi_item));
+    if (b.items == NULL) {
+        perror("malloc error");
+        return NULL;
+    }
+    memset(b.items, 0, (b.count + 1) * sizeof(struct multi_item));
+    for (i = 0; i < b.count; i++) {
+        b.items[i].req = (uds_command_t *)multi_iter_next(it);
+    }
+    STAT_ADD(sc->serv, envelopes, 1);
+    STAT_ADD(sc->serv, sub_requests, b.count);
+
+    /* This thread runs the sub-requests too */
+    nthread = 0;
+    if (it->flags & UDS_MULTI_PARALLEL) {
+        nthread = (cfg->multi_threads < b.count) ? cfg->multi_threads :
+            b.count;
+        nthread = (nthread > UDS_MAX_MULTI_THREADS) ?
+            UDS_MAX_MULTI_THREADS : nthread;
+        nthread = (nthread > 0) ? nthread - 1 : 0;
+    }
+    if (nthread > 0) {
+        pthread_mutex_lock(&pool->lock);
+        multi_pool_grow(sc->serv, nthread);
+        b.want = nthread;
+        pp = &pool->queue;
+        while (*pp != NULL) {
+            pp = &(*pp)->link;
+        }
+        *pp = &b;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    multi_run(&b);
+
+    /* No more helpers join the envelope once it is dequeued, wait for the
+     * ones running it */
+    if (nthread > 0) {
+        pthread_mutex_lock(&pool->lock);
+        if (b.want > 0) {
+            pp = &pool->queue;
+            while (*pp != &b) {
+                pp = &(*pp)->link;
+            }
+            *pp = b.link;
+        }
+        while (b.active > 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    /* Pack the sub-responses */
+    len = sizeof(uds_command_t) + sizeof(hdr);
+    for (i = 0; i < b.count; i++) {
+        len += sizeof(uds_command_t);
+        if (b.items[i].resp != NULL) {
+            len += b.items[i].resp->data_len;
+        }
+    }
+    resp = (uds_command_t *)uds_malloc(len);
+    p = NULL;
+    if (resp != NULL) {
+        resp->status = STATUS_SUCCESS;
+        resp->data_len = len - sizeof(uds_command_t);
+        hdr.count = (uint16_t)b.count;
+        hdr.flags = 0;
+        p = (uint8_t *)(resp + 1);
+        memcpy(p, &hdr, sizeof(hdr));
+        p += sizeof(hdr);
+    } else {
+        perror("malloc error");
+    }
+    for (i = 0; i < b.count; i++) {
+        sub = b.items[i].resp;
+        if ((p != NULL) && (sub != NULL)) {
+            len = sizeof(uds_command_t) + sub->data_len;
+            memcpy(p, sub, len);
+        } else if (p != NULL) {
+            len = sizeof(uds_command_t);
+            memset(p, 0, len);
+            ((uds_command_t *)p)->status = STATUS_ERROR;
+        }
+        if (p != NULL) {
+            ((uds_command_t *)p)->signature = UDS_SIGNATURE;
+            ((uds_command_t *)p)->checksum = 0;
+            p += len;
+        }
+        if ((sub != NULL) && !b.items[i].encoded) {
+            uds_free(sub);
+        }
+    }
+    uds_free(b.items);
+
+    return resp;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      dispatch_request
+ *
+ * DESCRIPTION: 
+ *      Pass the request to the admin commands or the request handler of
+ *      server, under admission control. An envelope is admitted once, and
+ *      charged by rate limiting for each of its sub-requests.
+ *
+ * PARAMETERS:
+ *      sc      - A pointer of connection info
+ *      req     - The request
+ *      status  - Return the status code if no response
+ *      encoded - Return 1 if the response is a constant one, which is
+ *                encoded already and shall not be changed or freed
+ *
+ * RETURN:
+ *      The response, NULL if rejected or the handler fails.
+ ******************************************************************************/
+static uds_command_t *dispatch_request(uds_connect_t *sc, uds_command_t *req,
+    uint32_t *status, int *encoded)
+{
+    uds_server_t *s = sc->serv;
+    const uds_server_config_t *cfg;
+    const uds_command_entry_t *entry;
+    uds_command_t *resp;
+    uds_multi_iter_t it;
+    uint32_t cost;
+    int64_t t0;
+    long ms;
+
+    *status = STATUS_ERROR;
+    *encoded = 0;
+    cfg = live_config(s);
+    SERVER_LOG(s, UDS_LOG_DEBUG, "Request 0x%X, %u bytes\n",
+        req->command, req->data_len);
+    STAT_ADD(s, requests, 1);
+
+    /* Admin commands are never rejected */
+    if (sc->listener->attr.admin) {
+        resp = admin_handle(s, req);
+        if (resp != NULL) {
+            return resp;
+        }
+    }
+
+    /* The fd of snapshot is passed by the connection thread with the
+     * response */
+    if (req->command == UDS_CMD_MAP_SNAPSHOT) {
+        *status = (s->snapshot_fd >= 0) ? STATUS_SUCCESS : STATUS_ERROR;
+        return NULL;
+    }
+
+    cost = 1;
+    if (req->command == UDS_CMD_MULTI) {
+        if (multi_iter_init(&it, req) != 0) {
+            SERVER_LOG(s, UDS_LOG_INFO, "Invalid envelope\n");
+            STAT_ADD(s, errors, 1);
+            return NULL;
+        }
+        cost = (it.left > 0) ? it.left : 1;
+    }
+
+    if (!rate_limit_check(sc->rate, cfg, cost)) {
+        STAT_ADD(s, rate_limited, 1);
+        *status = STATUS_BUSY;
+        return NULL;
+    }
+
+    /* Constant responses cost only the send, no admission needed */
+    entry = command_lookup(s, req->command);
+    if ((entry != NULL) && (entry->wire != NULL)) {
+        *encoded = 1;
+        return (uds_command_t *)entry->wire;
+    }
+
+    if (!admission_enter(s, cfg)) {
+        STAT_ADD(s, busy, 1);
+        *status = STATUS_BUSY;
+        return NULL;
+    }
+
+    t0 = now_ns();
+    if (req->command == UDS_CMD_MULTI) {
+        resp = dispatch_multi(sc, cfg, &it);
+    } else {
+        resp = call_handler(s, entry, req);
+    }
+    admission_leave(s, cfg);
+
+    if (cfg->slow_request_ms > 0) {
+        ms = (long)((now_ns() - t0) / 1000000);
+        if (ms >= cfg->slow_request_ms) {
+            STAT_ADD(s, slow_requests, 1);
+            SERVER_LOG(s, UDS_LOG_INFO, "Slow request 0x%X: %ld ms\n",
+                req->command, ms);
+        }
+    }
+
+    return resp;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      release_connection
+ *
+ * DESCRIPTION: 
+ *      Close the connection and give the slot back to the server.
+ *
+ * PARAMETERS:
+ *      sc - A pointer of connection info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void release_connection(uds_connect_t *sc)
+{
+    close(sc->client_fd);
+    if (sc->hot != NULL) {
+        STAT_ADD(sc->serv, sndbuf_bytes, -(uint64_t)sc->hot->sndbuf);
+        STAT_ADD(sc->serv, rcvbuf_bytes, -(uint64_t)sc->hot->rcvbuf);
+        sc->hot = NULL;         /* Freed by the thread of connection */
+    }
+    if (sc->listener != NULL) {
+        __atomic_sub_fetch(&sc->listener->nconn, 1, __ATOMIC_RELEASE);
+        __atomic_sub_fetch(&sc->serv->nconn, 1, __ATOMIC_RELEASE);
+    }
+    rate_bucket_put(sc->rate);
+    sc->rate = NULL;
+
+    /* The slot can be taken by the accepting thread from now */
+    __atomic_store_n(&sc->state, UDS_CONN_FREE, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      parse_cpu_list
+ *
+ * DESCRIPTION: 
+ *      Parse a CPU list like "0-3,8" (the format of cpulist in sysfs).
+ *
+ * PARAMETERS:
+ *      list - The CPU list
+ *      set  - Return the CPU set
+ *
+ * RETURN:
+ *      The count of CPUs in the set.
+ ******************************************************************************/
+static int parse_cpu_list(const char *list, cpu_set_t *set)
+{
+    const char *p = list;
+    char *end;
+    long first, last;
+
+    CPU_ZERO(set);
+    while (*p != '\0') {
+        first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+        }
+        for (; (first <= last) && (first < CPU_SETSIZE); first++) {
+            CPU_SET(first, set);
+        }
+        p = end;
+        while ((*p == ',') || (*p == '\n') || (*p == ' ')) {
+            p++;
+        }
+    }
+
+    return CPU_COUNT(set);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      peer_node_cpus
+ *
+ * DESCRIPTION: 
+ *      Get the CPUs of the NUMA node where a process ran last time, from
+ *      /proc/<pid>/stat and sysfs.
+ *
+ * PARAMETERS:
+ *      pid - The process id
+ *      set - Return the CPU set of the node
+ *
+ * RETURN:
+ *      The count of CPUs in the set, 0 if unknown.
+ ******************************************************************************/
+static int peer_node_cpus(pid_t pid, cpu_set_t *set)
+{
+    char path[64], line[1024];
+    struct dirent *de;
+    DIR *dir;
+    FILE *fp;
+    char *p;
+    int i, cpu = -1, node = -1;
+
+    /* The 39th field of stat is the CPU the process ran on */
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    p = fgets(line, sizeof(line), fp);
+    fclose(fp);
+    if ((p == NULL) || ((p = strrchr(line, ')')) == NULL)) {
+        return 0;
+    }
+    for (i = 2; (i < 39) && (p != NULL); i++) {
+        p = strchr(p + 1, ' ');
+    }
+    if (p != NULL) {
+        cpu = atoi(p + 1);
+    }
+    if (cpu < 0) {
+        return 0;
+    }
+
+    /* The node of the CPU is a "nodeN" link in its sysfs directory */
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if ((strncmp(de->d_name, "node", 4) == 0) &&
+                (de->d_name[4] >= '0') && (de->d_name[4] <= '9')) {
+            node = atoi(de->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    if (node < 0) {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+        node);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    p = fgets(line, sizeof(line), fp);
+    fclose(fp);
+
+    return (p != NULL) ? parse_cpu_list(line, set) : 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      place_connection_thread
+ *
+ * DESCRIPTION: 
+ *      Bind the connection thread to the CPUs in configuration, or to the
+ *      NUMA node of the peer process. Call it before the buffers of the
+ *      connection are allocated, so their pages are local to the node.
+ *
+ * PARAMETERS:
+ *      sc - A pointer of connection info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void place_connection_thread(uds_connect_t *sc)
+{
+    const uds_server_config_t *cfg = &sc->serv->config;
+    cpu_set_t cpus, node;
+    int count = 0;
+
+    /* A pre-forked worker is bound to its CPU already */
+    if ((cfg->cpu_list[0] != '\0') && (sc->serv->worker_id < 0)) {
+        count = parse_cpu_list(cfg->cpu_list, &cpus);
+    }
+
+    if (cfg->numa_follow_peer && (sc->peer_pid > 0) &&
+            (peer_node_cpus(sc->peer_pid, &node) > 0)) {
+        /* Stay in the CPUs of the pre-forked worker */
+        if ((count == 0) && (sc->serv->worker_id >= 0) &&
+                (pthread_getaffinity_np(pthread_self(), sizeof(cpus),
+                    &cpus) == 0)) {
+            count = CPU_COUNT(&cpus);
+        }
+        if (count > 0) {
+            CPU_AND(&node, &node, &cpus);
+        }
+        if (CPU_COUNT(&node) > 0) {
+            cpus = node;
+            count = CPU_COUNT(&node);
+        }
+    }
+
+    if ((count > 0) && (pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+            &cpus) != 0)) {
+        printf("Error: failed to set CPU affinity of connection thread\n");
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      adapt_sock_buffer
+ *
+ * DESCRIPTION: 
+ *      Follow the size of recent messages on one direction of a connection,
+ *      and resize its socket buffer to keep UDS_SOCKBUF_MSGS of them, within
+ *      [sockbuf_min, sockbuf_max]. The size follows a larger message at once
+ *      and decays by 1/8 per smaller one. The buffer grows as soon as it is
+ *      too small, but only shrinks when it is 4 times too large, so it does
+ *      not flip on every message.
+ *
+ * PARAMETERS:
+ *      sc  - The connection
+ *      cfg - The configuration of server
+ *      opt - SO_SNDBUF or SO_RCVBUF
+ *      avg - The recent message size of the direction
+ *      cur - The buffer size set on the direction
+ *      len - The length of this message
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void adapt_sock_buffer(uds_connect_t *sc, const uds_server_config_t *cfg,
+    int opt, uint32_t *avg, int *cur, size_t len)
+{
+    size_t want, lower, upper;
+    int size;
+
+    if (len >= *avg) {
+        *avg = len;
+    } else {
+        *avg -= (*avg - len) / 8;
+    }
+
+    upper = (cfg->sockbuf_max < INT_MAX / 2) ? cfg->sockbuf_max : INT_MAX / 2;
+    lower = (cfg->sockbuf_min < upper) ? cfg->sockbuf_min : upper;
+    want = (lower > 0) ? lower : 4096;
+    while ((want < (size_t)*avg * UDS_SOCKBUF_MSGS) && (want < upper)) {
+        want <<= 1;
+    }
+    size = (int)((want > upper) ? upper : want);
+    if ((size <= *cur) && (size * 4 > *cur)) {
+        return;
+    }
+
+    if (setsockopt(sc->client_fd, SOL_SOCKET, opt, &size, sizeof(size)) != 0) {
+        perror("setsockopt(SO_SNDBUF/SO_RCVBUF) error");
+        return;
+    }
+    if (opt == SO_SNDBUF) {
+        STAT_ADD(sc->serv, sndbuf_bytes, (uint64_t)(size - *cur));
+    } else {
+        STAT_ADD(sc->serv, rcvbuf_bytes, (uint64_t)(size - *cur));
+    }
+    STAT_ADD(sc->serv, sockbuf_resizes, 1);
+    *cur = size;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      send_with_fd
+ *
+ * DESCRIPTION: 
+ *      Send a packet with a file descriptor (SCM_RIGHTS). The fd comes with
+ *      the first byte of the packet.
+ *
+ * PARAMETERS:
+ *      sockfd - The socket fd
+ *      buf    - The packet
+ *      len    - Length of the packet
+ *      fd     - The file descriptor to pass
+ *
+ * RETURN:
+ *      Bytes sent, -1 if error.
+ ******************************************************************************/
+static ssize_t send_with_fd(int sockfd, const void *buf, size_t len, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctrl, 0, sizeof(ctrl));
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      request_handle_routine
+ *
+ * DESCRIPTION: 
+ *      A thread function to receive the request from client,
+ *      handle the request and send response back to client.
+ *
+ * PARAMETERS:
+ *      arg - A pointer of connection info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void *request_handle_routine(void *arg)
+{
+    uds_connect_t *sc = (uds_connect_t *)arg;
+    uds_connect_hot_t *hot;
+    uds_command_t *req;
+    uds_command_t *resp;
+    uint8_t *buf;
+    size_t buf_size;
+    ssize_t bytes, req_len, resp_len;
+    uint32_t status;
+    const uds_server_config_t *cfg;
+    int seqpacket, spin_us, encoded, pass_fd;
+    int64_t spent;
+
+    if (sc == NULL) {
+        printf("Error: invalid argument of thread routine\n");
+        pthread_exit(0);
+    }
+
+    /* Allocate the hot state and the buffer after placement, and touch them
+     * on the local node */
+    place_connection_thread(sc);
+    buf_size = sc->serv->config.buf_size;
+    hot = (uds_connect_hot_t *)alloc_cache_aligned(sizeof(uds_connect_hot_t) +
+        buf_size);
+    if (hot == NULL) {
+        perror("malloc error");
+        release_connection(sc);
+        pthread_exit(0);
+    }
+    memset(hot, 0, sizeof(uds_connect_hot_t) + buf_size);
+    buf = (uint8_t *)(hot + 1);
+    hot->buf = buf;
+    hot->buf_size = buf_size;
+    sc->hot = hot;
+
+    /* Adaptive buffers start from the lower bound, grow with the traffic */
+    epoch_enter(sc);
+    cfg = live_config(sc->serv);
+    if (cfg->sockbuf_max > 0) {
+        adapt_sock_buffer(sc, cfg, SO_RCVBUF, &hot->avg_req, &hot->rcvbuf, 0);
+        adapt_sock_buffer(sc, cfg, SO_SNDBUF, &hot->avg_resp, &hot->sndbuf,
+            0);
+    }
+    spin_us = cfg->busy_poll_us;
+    epoch_leave(sc);
+
+    /* Apply the priority of the listener to this thread */
+    if (sc->listener->attr.priority != 0) {
+        if (setpriority(PRIO_PROCESS, syscall(SYS_gettid),
+                sc->listener->attr.priority) != 0) {
+            perror("setpriority error");
+        }
+    }
+
+    seqpacket = (sc->serv->config.sock_type == SOCK_SEQPACKET);
+    while (1) {
+        /* Spin for a while before sleeping in recv() if busy poll enabled */
+        if (spin_us > 0) {
+            if (busy_poll(sc->client_fd, spin_us, &spent)) {
+                STAT_ADD(sc->serv, spin_hits, 1);
+            } else {
+                STAT_ADD(sc->serv, spin_misses, 1);
+            }
+            STAT_ADD(sc->serv, spin_ns, spent);
+        }
+
+        /* Receive request from client */
+        req_len = recv_packet(sc->client_fd, (char *)buf, buf_size, seqpacket);
+        if (req_len <= 0) {
+            release_connection(sc);
+            break;
+        }
+
+        /* Check the integrity of the request packet */
+        if (!verify_command_packet(buf, req_len)) {
+            /* Discard invaid packet */
+            STAT_ADD(sc->serv, errors, 1);
+            continue;
+        }
+
+        /* Process the request, the command table it uses is kept until
+         * the response is sent */
+        epoch_enter(sc);
+        req = (uds_command_t *)buf;
+        pass_fd = -1;
+        if ((req->command == UDS_CMD_MAP_SNAPSHOT) &&
+                (sc->serv->snapshot_fd >= 0)) {
+            pass_fd = sc->serv->snapshot_fd;
+        }
+        resp = dispatch_request(sc, req, &status, &encoded);
+        if (resp == NULL) {
+            resp = (uds_command_t *)buf;   /* Use a local buffer */
+            resp->status = status;
+            resp->data_len = 0;
+        }
+
+        resp_len = sizeof(uds_command_t) + resp->data_len;
+        cfg = live_config(sc->serv);
+        spin_us = cfg->busy_poll_us;
+        if (cfg->sockbuf_max > 0) {
+            adapt_sock_buffer(sc, cfg, SO_RCVBUF, &hot->avg_req,
+                &hot->rcvbuf, req_len);
+            adapt_sock_buffer(sc, cfg, SO_SNDBUF, &hot->avg_resp,
+                &hot->sndbuf, resp_len);
+        }
+        if (!encoded) {
+            resp->signature = req->signature;
+            resp->checksum = 0;
+            resp->checksum = compute_checksum(resp, resp_len);
+        }
+
+        /* Send response */
+        if (pass_fd >= 0) {
+            bytes = send_with_fd(sc->client_fd, resp, resp_len, pass_fd);
+        } else {
+            bytes = send(sc->client_fd, resp, resp_len, MSG_NOSIGNAL);
+        }
+        if (!encoded && (resp != (uds_command_t *)buf)) {
+            uds_free(resp);     /* If NOT local buffer or constant, free it */
+        }
+        epoch_leave(sc);
+        if (bytes != resp_len) {
+            printf("Error: send response error\n");
+            STAT_ADD(sc->serv, errors, 1);
+            release_connection(sc);
+            break;
+        }
+    }
+
+    uds_free(hot);
+    pthread_exit(0);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      set_sock_options
+ *
+ * DESCRIPTION: 
+ *      Set the receive timeout and buffer sizes of a connected socket.
+ *
+ * PARAMETERS:
+ *      fd           - The socket fd
+ *      recv_timeout - Timeout of recv()(ms), 0: no timeout
+ *      sndbuf       - SO_SNDBUF of socket, 0: no change
+ *      rcvbuf       - SO_RCVBUF of socket, 0: no change
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void set_sock_options(int fd, int recv_timeout, int sndbuf, int rcvbuf)
+{
+    struct timeval tv;
+
+    if (recv_timeout > 0) {
+        tv.tv_sec = recv_timeout / 1000;
+        tv.tv_usec = (recv_timeout % 1000) * 1000;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) {
+            perror("setsockopt(SO_RCVTIMEO) error");
+        }
+    }
+    if ((sndbuf > 0) && (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+            sizeof(sndbuf)) != 0)) {
+        perror("setsockopt(SO_SNDBUF) error");
+    }
+    if ((rcvbuf > 0) && (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+            sizeof(rcvbuf)) != 0)) {
+        perror("setsockopt(SO_RCVBUF) error");
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      make_sock_addr
+ *
+ * DESCRIPTION: 
+ *      Fill the socket address of unix domain socket. A path starts with '@'
+ *      is a Linux abstract socket address, the '@' is replaced by a NUL byte,
+ *      no file is created in the filesystem for it.
+ *
+ * PARAMETERS:
+ *      sock_path - The path of unix domain socket
+ *      addr      - The socket address to fill
+ *      len       - Return the length of socket address
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int make_sock_addr(const char *sock_path, struct sockaddr_un *addr,
+    socklen_t *len)
+{
+    size_t path_len;
+
+    if (sock_path == NULL) {
+        return -1;
+    }
+
+    path_len = strlen(sock_path);
+    if ((path_len == 0) || (path_len >= sizeof(addr->sun_path))) {
+        printf("Error: invalid socket path\n");
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, sock_path, path_len);
+    if (UDS_IS_ABSTRACT(sock_path)) {
+        /* The name of abstract socket isn't NUL-terminated */
+        addr->sun_path[0] = '\0';
+        *len = offsetof(struct sockaddr_un, sun_path) + path_len;
+    } else {
+        *len = sizeof(*addr);
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      listen_env_load
+ *
+ * DESCRIPTION: 
+ *      Read the count of sockets passed in by a service manager, following
+ *      the LISTEN_PID/LISTEN_FDS convention (sd_listen_fds), and unset the
+ *      variables so they aren't passed down to child processes. The sockets
+ *      are made close-on-exec.
+ *
+ * PARAMETERS:
+ *      None
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void listen_env_load(void)
+{
+    const char *env;
+    int fd;
+
+    env = getenv("LISTEN_PID");
+    if ((env != NULL) && (atol(env) == (long)getpid())) {
+        env = getenv("LISTEN_FDS");
+        listen_nfds = (env != NULL) ? atoi(env) : 0;
+        listen_nfds = (listen_nfds > 0) ? listen_nfds : 0;
+    }
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    for (fd = UDS_LISTEN_FDS_START; fd < UDS_LISTEN_FDS_START + listen_nfds;
+            fd++) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      inherited_listen_fd
+ *
+ * DESCRIPTION: 
+ *      Look for a listening socket passed in by a service manager. The
+ *      sockets are numbered from UDS_LISTEN_FDS_START, the one bound to
+ *      sock_path is picked. If there is only one socket, it is used by the
+ *      first listener regardless of path, as long as it is a bound unix
+ *      domain socket of the type in configuration.
+ *
+ * PARAMETERS:
+ *      sock_path - The path of unix domain socket
+ *      sock_type - The socket type in configuration
+ *
+ * RETURN:
+ *      The inherited socket fd, -1 if no suitable socket is passed in.
+ ******************************************************************************/
+static int inherited_listen_fd(const char *sock_path, int sock_type)
+{
+    struct sockaddr_un addr, path_addr;
+    socklen_t len, path_len;
+    int fd, val, match;
+
+    pthread_once(&listen_once, listen_env_load);
+    if ((listen_nfds <= 0) || ((listen_nfds == 1) && (listen_taken > 0))) {
+        return -1;
+    }
+    if (make_sock_addr(sock_path, &path_addr, &path_len) != 0) {
+        return -1;
+    }
+
+    for (fd = UDS_LISTEN_FDS_START; fd < UDS_LISTEN_FDS_START + listen_nfds;
+            fd++) {
+        /* Must be a listening unix domain socket of the type */
+        len = sizeof(val);
+        if ((getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &val, &len) != 0) ||
+                (val != AF_UNIX)) {
+            continue;
+        }
+        len = sizeof(val);
+        if ((getsockopt(fd, SOL_SOCKET, SO_TYPE, &val, &len) != 0) ||
+                (val != sock_type)) {
+            continue;
+        }
+        len = sizeof(val);
+        if ((getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) != 0) ||
+                (val == 0)) {
+            continue;
+        }
+
+        /* An unbound socket has no more than the family */
+        memset(&addr, 0, sizeof(addr));
+        len = sizeof(addr);
+        if ((getsockname(fd, (struct sockaddr *)&addr, &len) != 0) ||
+                (len <= offsetof(struct sockaddr_un, sun_path))) {
+            continue;
+        }
+        if (UDS_IS_ABSTRACT(sock_path)) {
+            match = (len == path_len) &&
+                (memcmp(addr.sun_path, path_addr.sun_path,
+                    path_len - offsetof(struct sockaddr_un, sun_path)) == 0);
+        } else {
+            match = (strncmp(addr.sun_path, path_addr.sun_path,
+                sizeof(addr.sun_path)) == 0);
+        }
+        if ((listen_nfds == 1) || match) {
+            listen_taken++;
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      listener_open
+ *
+ * DESCRIPTION: 
+ *      Create a listening socket on the path. If a listening socket for
+ *      sock_path is passed in by a service manager (socket activation), it
+ *      is used directly instead of creating a new one.
+ *
+ * PARAMETERS:
+ *      sock_path - The path of unix domain socket, "@name" for an abstract
+ *                  socket address
+ *      cfg       - The configuration of server
+ *
+ * RETURN:
+ *      The listening socket fd, -1 if error.
+ ******************************************************************************/
+static int listener_open(const char *sock_path, const uds_server_config_t *cfg)
+{
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    int fd, rc;
+
+    if (make_sock_addr(sock_path, &addr, &addr_len) != 0) {
+        return -1;
+    }
+
+    /* Use the socket opened by service manager if there is one */
+    fd = inherited_listen_fd(sock_path, cfg->sock_type);
+    if (fd >= 0) {
+        return fd;
+    }
+
+    /* No file to remove for abstract socket */
+    if (!UDS_IS_ABSTRACT(sock_path)) {
+        unlink(sock_path);
+    }
+
+    fd = socket(AF_UNIX, cfg->sock_type, 0);
+    if (fd < 0) {
+        perror("socket error");
+        return -1;
+    }
+
+    /* Avoid "Address already in use" error in bind() */
+    //int val = 1;
+    //if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val,
+    //        sizeof(val)) == -1) {
+    //    perror("setsockopt error");
+    //    return -1;
+    //}
+
+    rc = bind(fd, (struct sockaddr *) &addr, addr_len);
+    if (rc != 0) {
+        perror("bind error");
+        close(fd);
+        return -1;
+    }
+
+    rc = listen(fd, cfg->backlog);
+    if (rc != 0) {
+        perror("listen error");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      snapshot_create
+ *
+ * DESCRIPTION: 
+ *      Create the snapshot published to clients in a memfd. The server maps
+ *      it writable, then seals it so the clients can neither resize it nor
+ *      map it writable (F_SEAL_FUTURE_WRITE, Linux 5.1+). It fails without
+ *      the write seal, unless snapshot_unsealed is set.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int snapshot_create(uds_server_t *s)
+{
+    size_t size, page;
+    void *p;
+    int fd, seals;
+
+    if (s->config.snapshot_size > UINT32_MAX - sizeof(uds_snapshot_t)) {
+        printf("Error: snapshot_size is too large\n");
+        return -1;
+    }
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    size = (sizeof(uds_snapshot_t) + s->config.snapshot_size + page - 1) /
+        page * page;
+
+    fd = memfd_create("uds-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("memfd_create error");
+        return -1;
+    }
+    if (ftruncate(fd, size) != 0) {
+        perror("ftruncate error");
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap error");
+        close(fd);
+        return -1;
+    }
+    snapshot_init((uds_snapshot_t *)p, s->config.snapshot_size);
+
+    /* Without F_SEAL_FUTURE_WRITE (before Linux 5.1) clients could map
+     * it writable, go on only if it is allowed */
+    seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+    if (fcntl(fd, F_ADD_SEALS, seals | F_SEAL_FUTURE_WRITE) != 0) {
+        if (!s->config.snapshot_unsealed) {
+            perror("fcntl(F_SEAL_FUTURE_WRITE) error");
+            munmap(p, size);
+            close(fd);
+            return -1;
+        }
+        printf("Warning: snapshot is not sealed against writes of "
+            "clients\n");
+        if (fcntl(fd, F_ADD_SEALS, seals) != 0) {
+            perror("fcntl(F_ADD_SEALS) error");
+            munmap(p, size);
+            close(fd);
+            return -1;
+        }
+    }
+
+    s->snapshot = (uds_snapshot_t *)p;
+    s->snapshot_fd = fd;
+    s->snapshot_map_size = size;
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_init
+ *
+ * DESCRIPTION: 
+ *      Do some initialzation work for server with default configuration.
+ *
+ * PARAMETERS:
+ *      sock_path - The path of unix domain socket, "@name" for an abstract
+ *                  socket address
+ *      req_handler - The function pointer of a user-defined request handler.
+ *
+ * RETURN:
+ *      A pointer of server info.
+ ******************************************************************************/
+uds_server_t *server_init(const char *sock_path, request_handler_t req_handler)
+{
+    uds_server_config_t cfg;
+
+    server_config_init(&cfg);
+    return server_init_config(sock_path, req_handler, &cfg);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_init_config
+ *
+ * DESCRIPTION: 
+ *      Do some initialzation work for server, and create the first listener
+ *      of the server with default policy.
+ *
+ * PARAMETERS:
+ *      sock_path - The path of unix domain socket, "@name" for an abstract
+ *                  socket address
+ *      req_handler - The function pointer of a user-defined request handler,
+ *                  NULL if it's set by server_set_handler_ctx() later.
+ *      cfg       - The configuration of server
+ *
+ * RETURN:
+ *      A pointer of server info.
+ ******************************************************************************/
+uds_server_t *server_init_config(const char *sock_path,
+    request_handler_t req_handler, const uds_server_config_t *cfg)
+{
+    uds_server_t *s;
+    int i;
+
+    if ((cfg == NULL) ||
+            (cfg->buf_size < sizeof(uds_command_t)) ||
+            (cfg->backlog <= 0) || (cfg->max_client <= 0)) {
+        printf("Error: invalid parameter!\n");
+        return NULL;
+    }
+    if ((cfg->engine == UDS_ENGINE_PREFORK) &&
+            ((cfg->workers <= 0) || (cfg->workers > UDS_MAX_WORKER))) {
+        printf("Error: workers shall be 1~%d in pre-fork mode\n",
+            UDS_MAX_WORKER);
+        return NULL;
+    }
+
+    s = (uds_server_t *)uds_malloc(sizeof(uds_server_t));
+    if (s == NULL) {
+        perror("malloc error");
+        return NULL;
+    }
+    memset(s, 0, sizeof(uds_server_t));
+    s->config = *cfg;
+    s->snapshot_fd = -1;
+
+    s->conn = (uds_connect_t *)alloc_cache_aligned(cfg->max_client *
+        sizeof(uds_connect_t));
+    if (s->conn == NULL) {
+        perror("malloc error");
+        uds_free(s);
+        return NULL;
+    }
+    memset(s->conn, 0, cfg->max_client * sizeof(uds_connect_t));
+    for (i = 0; i < cfg->max_client; i++) {
+        s->conn[i].serv = s;
+    }
+    s->readers = (uds_reader_epoch_t *)alloc_cache_aligned(cfg->max_client *
+        sizeof(uds_reader_epoch_t));
+    if (s->readers == NULL) {
+        perror("malloc error");
+        uds_free(s->conn);
+        uds_free(s);
+        return NULL;
+    }
+    memset(s->readers, 0, cfg->max_client * sizeof(uds_reader_epoch_t));
+    s->epfd = -1;
+    s->stats = &s->local_stats;
+    s->worker_id = -1;
+
+    /* The live configuration and rate limiting buckets are shared with the
+     * workers forked later */
+    s->shared_config = (struct uds_config_shared *)mmap(NULL,
+        sizeof(struct uds_config_shared), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    s->rate_buckets = (uds_rate_bucket_t *)mmap(NULL,
+        UDS_RATE_BUCKETS * sizeof(uds_rate_bucket_t), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    s->live_config = (struct uds_config_snapshot *)uds_malloc(
+        sizeof(struct uds_config_snapshot));
+    if ((s->shared_config == MAP_FAILED) || (s->rate_buckets == MAP_FAILED) ||
+            (s->live_config == NULL)) {
+        perror("malloc error");
+        if (s->shared_config != MAP_FAILED) {
+            munmap(s->shared_config, sizeof(struct uds_config_shared));
+        }
+        if (s->rate_buckets != MAP_FAILED) {
+            munmap(s->rate_buckets,
+                UDS_RATE_BUCKETS * sizeof(uds_rate_bucket_t));
+        }
+        uds_free(s->live_config);
+        uds_free(s->readers);
+        uds_free(s->conn);
+        uds_free(s);
+        return NULL;
+    }
+    s->shared_config->seq = 0;
+    s->shared_config->config = *cfg;
+    doorbell_init(&s->shared_config->changed);
+    memset(s->live_config, 0, sizeof(struct uds_config_snapshot));
+    s->live_config->config = *cfg;
+    pthread_mutex_init(&s->config_lock, NULL);
+    pthread_mutex_init(&s->admission.lock, NULL);
+    pthread_cond_init(&s->admission.cond, NULL);
+    pthread_mutex_init(&s->multi_pool.lock, NULL);
+    pthread_cond_init(&s->multi_pool.work, NULL);
+    pthread_cond_init(&s->multi_pool.done, NULL);
+    pthread_mutex_init(&s->commands_lock, NULL);
+
+    /* Updates of the command table run the barrier for the readers if
+     * membarrier() is supported, the readers run it themselves if not */
+    s->epoch = 1;
+    s->membarrier = (syscall(SYS_membarrier,
+        MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0);
+
+    /* The snapshot is shared with the workers forked later too */
+    if ((cfg->snapshot_size > 0) && (snapshot_create(s) != 0)) {
+        server_close(s);
+        return NULL;
+    }
+
+    /* Setup request handler */
+    s->request_handler = req_handler;
+
+    if (server_add_listener(s, sock_path, NULL) != 0) {
+        server_close(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_set_handler_ctx
+ *
+ * DESCRIPTION: 
+ *      Set a request handler with a user context, which is used instead of
+ *      the request handler passed to server_init(). Call it before
+ *      server_run(). The handler is called by all connection threads at the
+ *      same time, so it shall be thread-safe.
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      handler - The request handler
+ *      ctx     - The context passed to the handler
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void server_set_handler_ctx(uds_server_t *s, request_handler_ctx_t handler,
+    void *ctx)
+{
+    if (s == NULL) {
+        return;
+    }
+    s->handler_ctx = ctx;
+    s->handler_ctx_fn = handler;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      command_reclaim
+ *
+ * DESCRIPTION: 
+ *      Free the retired command tables which no request can use: every
+ *      connection thread is idle, or started its request after the table
+ *      was retired. Called with commands_lock held, it doesn't wait.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      The oldest epoch of requests running, 0 if none.
+ ******************************************************************************/
+static uint64_t command_reclaim(uds_server_t *s)
+{
+    uds_command_table_t **pt, *t;
+    uint64_t oldest;
+
+    oldest = epoch_oldest(s);
+    pt = &s->retired;
+    while ((t = *pt) != NULL) {
+        if ((oldest == 0) || (oldest >= t->retire_epoch)) {
+            *pt = t->retired;
+            uds_free((void *)t->dropped);
+            uds_free(t);
+        } else {
+            pt = &t->retired;
+        }
+    }
+
+    return oldest;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      command_update
+ *
+ * DESCRIPTION: 
+ *      Add, replace or remove a command: publish a new command table with
+ *      the change, retire the old one. The requests running go on with the
+ *      old table, the next ones use the new one. It never blocks them.
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      command - The request type
+ *      entry   - The new entry of command, NULL to remove it
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int command_update(uds_server_t *s, uint32_t command,
+    const uds_command_entry_t *entry)
+{
+    uds_command_table_t *old, *t;
+    const uds_command_t *dropped;
+    int i, j, n, pos, found;
+
+    pthread_mutex_lock(&s->commands_lock);
+
+    old = s->commands;
+    n = (old != NULL) ? old->count : 0;
+    for (pos = 0; (pos < n) && (old->entries[pos].command < command); pos++) {
+        continue;
+    }
+    found = (pos < n) && (old->entries[pos].command == command);
+    if ((entry == NULL) && !found) {
+        pthread_mutex_unlock(&s->commands_lock);
+        printf("Error: command 0x%X is not registered\n", command);
+        return -1;
+    }
+
+    n = n - found + (entry != NULL);
+    t = (uds_command_table_t *)uds_malloc(sizeof(uds_command_table_t) +
+        n * sizeof(uds_command_entry_t));
+    if (t == NULL) {
+        pthread_mutex_unlock(&s->commands_lock);
+        perror("malloc error");
+        return -1;
+    }
+    memset(t, 0, sizeof(uds_command_table_t));
+    t->entries = (uds_command_entry_t *)(t + 1);
+    t->count = n;
+
+    /* Copy the entries but the one changed, keep them sorted */
+    for (i = 0, j = 0; (old != NULL) && (i < old->count); i++) {
+        if (i == pos) {
+            if (entry != NULL) {
+                t->entries[j++] = *entry;
+            }
+            if (found) {
+                continue;
+            }
+        }
+        t->entries[j++] = old->entries[i];
+    }
+    if ((entry != NULL) && (j < n)) {
+        t->entries[j++] = *entry;
+    }
+    dropped = (found && old->entries[pos].owned) ?
+        old->entries[pos].wire : NULL;
+
+    __atomic_store_n(&s->commands, t, __ATOMIC_RELEASE);
+    if (old != NULL) {
+        old->dropped = dropped;
+        old->retire_epoch = __atomic_add_fetch(&s->epoch, 1,
+            __ATOMIC_SEQ_CST);
+        old->retired = s->retired;
+        s->retired = old;
+    }
+    command_reclaim(s);
+
+    pthread_mutex_unlock(&s->commands_lock);
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_set_const_response
+ *
+ * DESCRIPTION: 
+ *      Register a constant response of a request type, e.g. the version.
+ *      The packet, including the checksum, is built once here, the request
+ *      is answered with it without calling the request handler. It can be
+ *      called while the server is running.
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      command - The request type
+ *      status  - The status of response
+ *      data    - The data of response
+ *      len     - The length of data
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_set_const_response(uds_server_t *s, uint32_t command,
+    uint32_t status, const void *data, uint32_t len)
+{
+    uds_command_entry_t entry;
+    uds_command_t *wire;
+    size_t size = sizeof(uds_command_t) + len;
+
+    if ((s == NULL) || ((data == NULL) && (len > 0)) ||
+            (size > s->config.buf_size)) {
+        printf("Error: invalid parameter!\n");
+        return -1;
+    }
+
+    wire = (uds_command_t *)uds_malloc(size);
+    if (wire == NULL) {
+        perror("malloc error");
+        return -1;
+    }
+    wire->signature = UDS_SIGNATURE;
+    wire->status = status;
+    wire->data_len = len;
+    if (len > 0) {
+        memcpy(wire + 1, data, len);
+    }
+    wire->checksum = 0;
+    wire->checksum = compute_checksum(wire, size);
+
+    memset(&entry, 0, sizeof(entry));
+    entry.command = command;
+    entry.wire = wire;
+    entry.owned = 1;
+    if (command_update(s, command, &entry) != 0) {
+        uds_free(wire);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_set_static_response
+ *
+ * DESCRIPTION: 
+ *      Register a constant response which is encoded already, e.g. built
+ *      at compile time by uds::make_const_response() in uds.hpp. It is sent
+ *      from where it is without copy, so it shall live as long as the
+ *      server. It can be called while the server is running.
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      command - The request type
+ *      wire    - The packet with signature and checksum
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_set_static_response(uds_server_t *s, uint32_t command,
+    const uds_command_t *wire)
+{
+    uds_command_entry_t entry;
+
+    if ((s == NULL) || (wire == NULL) || !verify_command_packet((void *)wire,
+            sizeof(uds_command_t) + wire->data_len)) {
+        printf("Error: invalid parameter!\n");
+        return -1;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.command = command;
+    entry.wire = wire;
+    return command_update(s, command, &entry);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_register_command
+ *
+ * DESCRIPTION: 
+ *      Register a handler of a request type, it is called instead of the
+ *      request handler of server, e.g. by a plugin loaded at runtime. It
+ *      replaces the handler or constant response of the command, and can
+ *      be called while the server is running: the requests running finish
+ *      with the old one, the dispatch takes no lock. It changes the table
+ *      of this process only, call it before server_prefork().
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      command - The request type
+ *      handler - The handler, it shall be thread-safe
+ *      ctx     - The context passed to the handler
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_register_command(uds_server_t *s, uint32_t command,
+    request_handler_ctx_t handler, void *ctx)
+{
+    uds_command_entry_t entry;
+
+    if ((s == NULL) || (handler == NULL)) {
+        printf("Error: invalid parameter!\n");
+        return -1;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.command = command;
+    entry.handler = handler;
+    entry.ctx = ctx;
+    return command_update(s, command, &entry);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_unregister_command
+ *
+ * DESCRIPTION: 
+ *      Remove the handler or constant response of a request type, the
+ *      request handler of server answers it again. The old handler may be
+ *      still running when it returns, wait for it by server_synchronize().
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      command - The request type
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_unregister_command(uds_server_t *s, uint32_t command)
+{
+    if (s == NULL) {
+        printf("Error: invalid parameter!\n");
+        return -1;
+    }
+
+    return command_update(s, command, NULL);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_synchronize
+ *
+ * DESCRIPTION: 
+ *      Wait until the requests started before the call are done, so the
+ *      handlers replaced or removed are not running any more, e.g. before
+ *      unloading the plugin. The requests are not blocked by it. Don't call
+ *      it in a request handler, it would wait for itself.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void server_synchronize(uds_server_t *s)
+{
+    uint64_t epoch, oldest;
+
+    if (s == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&s->commands_lock);
+    epoch = __atomic_add_fetch(&s->epoch, 1, __ATOMIC_SEQ_CST);
+    while (((oldest = command_reclaim(s)) != 0) && (oldest < epoch)) {
+        pthread_mutex_unlock(&s->commands_lock);
+        usleep(1000);
+        pthread_mutex_lock(&s->commands_lock);
+    }
+    pthread_mutex_unlock(&s->commands_lock);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_add_listener
+ *
+ * DESCRIPTION: 
+ *      Listen on one more socket path. All listeners share the request
+ *      handler of the server, each one has its own connection limit and
+ *      priority of connection threads.
+ *
+ * PARAMETERS:
+ *      s         - A pointer of server info
+ *      sock_path - The path of unix domain socket, "@name" for an abstract
+ *                  socket address
+ *      attr      - The policy of the listener, NULL for default policy
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_add_listener(uds_server_t *s, const char *sock_path,
+    const uds_listener_attr_t *attr)
+{
+    uds_listener_t *l;
+
+    if ((s == NULL) || (sock_path == NULL)) {
+        printf("Error: invalid parameter!\n");
+        return -1;
+    }
+    if (s->listener_count >= UDS_MAX_LISTENER) {
+        printf("Error: too many listeners\n");
+        return -1;
+    }
+
+    l = &s->listener[s->listener_count];
+    memset(l, 0, sizeof(uds_listener_t));
+    if (attr != NULL) {
+        l->attr = *attr;
+    }
+    if ((l->attr.max_client <= 0) ||
+            (l->attr.max_client > s->config.max_client)) {
+        l->attr.max_client = s->config.max_client;
+    }
+
+    l->sockfd = listener_open(sock_path, &s->config);
+    if (l->sockfd < 0) {
+        return -1;
+    }
+    s->listener_count++;
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      wait_listener
+ *
+ * DESCRIPTION: 
+ *      Wait until one of the listeners has a pending connection. The scan
+ *      starts after the listener picked last time, so a busy listener can't
+ *      starve the others. The epoll fd is created in the process who waits
+ *      on it, with EPOLLEXCLUSIVE, so only one pre-forked worker is woken up
+ *      for a new connection.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      The listener with pending connection, NULL if error.
+ ******************************************************************************/
+static uds_listener_t *wait_listener(uds_server_t *s)
+{
+    struct epoll_event ev[UDS_MAX_LISTENER];
+    int i, j, n, count;
+
+    if (s->listener_count == 1) {
+        /* Block in accept() directly, the kernel wakes only one waiter */
+        return &s->listener[0];
+    }
+
+    if (s->epfd < 0) {
+        s->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (s->epfd < 0) {
+            perror("epoll_create1 error");
+            return NULL;
+        }
+        for (i = 0; i < s->listener_count; i++) {
+            memset(&ev[0], 0, sizeof(ev[0]));
+            ev[0].events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev[0].data.u32 = i;
+            if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->listener[i].sockfd,
+                    &ev[0]) != 0) {
+                perror("epoll_ctl error");
+            }
+
+            /* Another worker may take the connection first */
+            fcntl(s->listener[i].sockfd, F_SETFL,
+                fcntl(s->listener[i].sockfd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+
+    count = epoll_wait(s->epfd, ev, UDS_MAX_LISTENER, -1);
+    if (count <= 0) {
+        if ((count < 0) && (errno != EINTR)) {
+            perror("epoll_wait error");
+        }
+        return NULL;
+    }
+
+    for (i = 1; i <= s->listener_count; i++) {
+        n = (s->last_listener + i) % s->listener_count;
+        for (j = 0; j < count; j++) {
+            if (ev[j].data.u32 == (uint32_t)n) {
+                s->last_listener = n;
+                return &s->listener[n];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_accept_request
+ *
+ * DESCRIPTION: 
+ *      Accept a request from client and start a new thread to process it.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_accept_request(uds_server_t *s)
+{
+    uds_connect_t *sc;
+    uds_listener_t *l;
+    uds_server_config_t cfg;
+    pthread_attr_t attr;
+    struct ucred cred;
+    socklen_t len;
+    int cl, i, rc, state;
+
+    if ((s == NULL) || (s->listener_count == 0)) {
+        printf("Error: invalid parameter!\n");
+        return -1;
+    }
+
+    l = wait_listener(s);
+    if (l == NULL) {
+        return -1;
+    }
+
+    cl = accept(l->sockfd, NULL, NULL);
+    if (cl < 0) {
+        if (errno != EAGAIN) {
+            perror("accept error");
+        }
+        return -1;
+    }
+
+    /* Check the connection limit of the listener */
+    if (__atomic_load_n(&l->nconn, __ATOMIC_ACQUIRE) >= l->attr.max_client) {
+        printf("Error: too many connections on listener\n");
+        STAT_ADD(s, rejected, 1);
+        close(cl);
+        return -1;
+    }
+
+    /* Check the connection limit of the server */
+    config_copy(s, &cfg);
+    if (__atomic_load_n(&s->nconn, __ATOMIC_ACQUIRE) >= cfg.max_client) {
+        printf("Error: too many connections\n");
+        STAT_ADD(s, rejected, 1);
+        close(cl);
+        return -1;
+    }
+
+    /* Take a free slot for the connection, a slot is given back by the
+     * thread of its connection at any time */
+    for (i = 0; i < s->config.max_client; i++) {
+        state = UDS_CONN_FREE;
+        if (__atomic_compare_exchange_n(&s->conn[i].state, &state,
+                UDS_CONN_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (i >= s->config.max_client) {
+        printf("Error: too many connections\n");
+        STAT_ADD(s, rejected, 1);
+        close(cl);
+        return -1;
+    }
+
+    /* Start a new thread to handle the request */
+    sc = &s->conn[i];
+    sc->client_fd = cl;
+    sc->hot = NULL;
+    sc->listener = l;
+
+    /* Identity of the peer, it can't be changed for the connection */
+    len = sizeof(cred);
+    if (getsockopt(cl, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+        sc->peer_pid = cred.pid;
+        sc->peer_uid = cred.uid;
+        sc->peer_gid = cred.gid;
+    } else {
+        perror("getsockopt(SO_PEERCRED) error");
+        sc->peer_pid = 0;
+        sc->peer_uid = (uid_t)-1;
+        sc->peer_gid = (gid_t)-1;
+    }
+    sc->rate = rate_bucket_get(s, (s->config.rate_key == UDS_RATE_KEY_PID) ?
+        (uint32_t)sc->peer_pid : (uint32_t)sc->peer_uid);
+
+    __atomic_add_fetch(&l->nconn, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&s->nconn, 1, __ATOMIC_RELEASE);
+
+    /* Adaptive buffers are set by the thread of connection */
+    if (cfg.sockbuf_max > 0) {
+        set_sock_options(cl, cfg.recv_timeout, 0, 0);
+    } else {
+        set_sock_options(cl, cfg.recv_timeout, cfg.sndbuf, cfg.rcvbuf);
+    }
+
+    pthread_attr_init(&attr);
+    if (l->attr.stack_size > 0) {
+        pthread_attr_setstacksize(&attr, l->attr.stack_size);
+    } else if (s->config.stack_size > 0) {
+        pthread_attr_setstacksize(&attr, s->config.stack_size);
+    }
+    rc = pthread_create(&sc->thread_id, &attr, request_handle_routine, sc);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        perror("pthread_create error");
+        release_connection(sc);
+        return -1;
+    }
+    STAT_ADD(s, connections, 1);
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      prefork_worker
+ *
+ * DESCRIPTION: 
+ *      Fork a worker process. The worker accepts connections on the
+ *      listening sockets inherited from the master until run_flag is cleared
+ *      or it is killed by the master.
+ *
+ * PARAMETERS:
+ *      s        - A pointer of server info
+ *      id       - The index of the worker
+ *      run_flag - The worker keeps running while *run_flag is not 0
+ *
+ * RETURN:
+ *      The pid of worker in master, -1 if error. Never return in worker.
+ ******************************************************************************/
+static pid_t prefork_worker(uds_server_t *s, int id,
+    volatile sig_atomic_t *run_flag)
+{
+    cpu_set_t cpus;
+    pid_t pid;
+    int n, cpu;
+
+    pid = fork();
+    if (pid != 0) {
+        if (pid < 0) {
+            perror("fork error");
+        }
+        return pid;
+    }
+
+    /* The epoll fd of master can't be shared by workers */
+    if (s->epfd >= 0) {
+        close(s->epfd);
+        s->epfd = -1;
+    }
+    s->stats = &s->worker_stats[id];
+    s->worker_id = id;
+    signal(SIGTERM, SIG_DFL);
+
+    /* A worker per CPU of the CPU list */
+    if ((s->config.cpu_list[0] != '\0') &&
+            (parse_cpu_list(s->config.cpu_list, &cpus) > 0)) {
+        for (n = id % CPU_COUNT(&cpus), cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &cpus) && (n-- == 0)) {
+                break;
+            }
+        }
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            perror("sched_setaffinity error");
+        }
+    }
+
+    while (*run_flag) {
+        server_accept_request(s);
+    }
+
+    _exit(0);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_prefork
+ *
+ * DESCRIPTION: 
+ *      Run the server in pre-fork mode. The master forks some worker
+ *      processes who accept connections on the same listening sockets, and
+ *      restarts the worker who exits unexpectedly. The count of workers
+ *      follows "workers" of the live configuration. Return after run_flag
+ *      is cleared and all workers are stopped.
+ *
+ * PARAMETERS:
+ *      s        - A pointer of server info
+ *      nworkers - The count of worker processes
+ *      run_flag - The server keeps running while *run_flag is not 0
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_prefork(uds_server_t *s, int nworkers,
+    volatile sig_atomic_t *run_flag)
+{
+    pid_t pids[UDS_MAX_WORKER];
+    time_t started[UDS_MAX_WORKER];
+    uds_server_config_t cfg;
+    char text[32];
+    pid_t pid;
+    uint32_t seen;
+    int i, status;
+
+    if ((s == NULL) || (run_flag == NULL) ||
+            (nworkers <= 0) || (nworkers > UDS_MAX_WORKER) ||
+            (s->worker_stats != NULL)) {
+        printf("Error: invalid parameter!\n");
+        return -1;
+    }
+
+    /* Workers keep their statistics in a mapping shared with master */
+    s->worker_stats = (uds_stats_t *)mmap(NULL,
+        UDS_MAX_WORKER * sizeof(uds_stats_t), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s->worker_stats == MAP_FAILED) {
+        perror("mmap error");
+        s->worker_stats = NULL;
+        return -1;
+    }
+    memset(s->worker_stats, 0, UDS_MAX_WORKER * sizeof(uds_stats_t));
+    s->worker_count = UDS_MAX_WORKER;
+
+    snprintf(text, sizeof(text), "workers = %d", nworkers);
+    server_reconfigure(s, text);
+
+    memset(pids, 0, sizeof(pids));
+    memset(started, 0, sizeof(started));
+    while (*run_flag) {
+        seen = doorbell_seq(&s->shared_config->changed);
+        config_copy(s, &cfg);
+        nworkers = cfg.workers;
+
+        /* Reap the workers who exited */
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < UDS_MAX_WORKER; i++) {
+                if (pids[i] != pid) {
+                    continue;
+                }
+                pids[i] = 0;
+                if ((i < nworkers) && *run_flag) {
+                    if (cfg.log_level >= UDS_LOG_INFO) {
+                        printf("Worker %d (pid %d) exited (status 0x%x), "
+                            "restart it\n", i, pid, status);
+                    }
+                    STAT_ADD(s, worker_restarts, 1);
+                }
+            }
+        }
+        if (!*run_flag) {
+            break;
+        }
+
+        /* Start the missing workers and stop the extra ones */
+        for (i = 0; i < UDS_MAX_WORKER; i++) {
+            if ((i < nworkers) && (pids[i] <= 0)) {
+                /* Don't restart a worker who crashes at startup too fast */
+                if (time(NULL) - started[i] < 1) {
+                    continue;
+                }
+                pids[i] = prefork_worker(s, i, run_flag);
+                started[i] = time(NULL);
+            } else if ((i >= nworkers) && (pids[i] > 0)) {
+                kill(pids[i], SIGTERM);
+            }
+        }
+
+        /* Rescale the workers as soon as the config is changed by any
+         * worker, check the exited workers periodically */
+        doorbell_wait(&s->shared_config->changed, seen, UDS_PREFORK_POLL_MS);
+    }
+
+    /* Stop all workers */
+    for (i = 0; i < UDS_MAX_WORKER; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {
+        ;
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_run
+ *
+ * DESCRIPTION: 
+ *      Accept and handle requests with the engine in server configuration,
+ *      until run_flag is cleared.
+ *
+ * PARAMETERS:
+ *      s        - A pointer of server info
+ *      run_flag - The server keeps running while *run_flag is not 0
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_run(uds_server_t *s, volatile sig_atomic_t *run_flag)
+{
+    if ((s == NULL) || (run_flag == NULL)) {
+        printf("Error: invalid parameter!\n");
         return -1;
     }
 
-    cl = accept(s->sockfd, NULL, NULL);
-    if (cl < 0) {
-        perror("accept error");
-        return -1;
-    }
+    if (s->config.engine == UDS_ENGINE_PREFORK) {
+        return server_prefork(s, s->config.workers, run_flag);
+    }
+
+    while (*run_flag) {
+        server_accept_request(s);
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_get_stats
+ *
+ * DESCRIPTION: 
+ *      Get the statistics of server. In pre-fork mode, the statistics of
+ *      all worker processes are added up.
+ *
+ * PARAMETERS:
+ *      s     - A pointer of server info
+ *      stats - Return the statistics
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void server_get_stats(uds_server_t *s, uds_stats_t *stats)
+{
+    uds_stats_t *st;
+    int i;
+
+    if ((s == NULL) || (stats == NULL)) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(uds_stats_t));
+    for (i = -1; i < s->worker_count; i++) {
+        st = (i < 0) ? &s->local_stats : &s->worker_stats[i];
+        STAT_SUM(stats, st, connections);
+        STAT_SUM(stats, st, rejected);
+        STAT_SUM(stats, st, requests);
+        STAT_SUM(stats, st, errors);
+        STAT_SUM(stats, st, worker_restarts);
+        STAT_SUM(stats, st, slow_requests);
+        STAT_SUM(stats, st, busy);
+        STAT_SUM(stats, st, rate_limited);
+        STAT_SUM(stats, st, spin_hits);
+        STAT_SUM(stats, st, spin_misses);
+        STAT_SUM(stats, st, spin_ns);
+        STAT_SUM(stats, st, sockbuf_resizes);
+        STAT_SUM(stats, st, sndbuf_bytes);
+        STAT_SUM(stats, st, rcvbuf_bytes);
+        STAT_SUM(stats, st, envelopes);
+        STAT_SUM(stats, st, sub_requests);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_close
+ *
+ * DESCRIPTION: 
+ *      Close the socket fd and free memory.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void server_close(uds_server_t *s)
+{
+    struct uds_config_snapshot *snap;
+    uds_command_table_t *table;
+    int i;
+
+    printf("Server closing\n");
+
+    if (s == NULL) {
+        return;
+    }
+
+    for (i = 0; i < s->config.max_client; i++) {
+        if (__atomic_load_n(&s->conn[i].state, __ATOMIC_ACQUIRE) !=
+                UDS_CONN_FREE) {
+            pthread_join(s->conn[i].thread_id, NULL);
+            close(s->conn[i].client_fd);
+        }
+    }
+
+    multi_pool_stop(s);
+
+    for (i = 0; i < s->listener_count; i++) {
+        close(s->listener[i].sockfd);
+    }
+    if (s->epfd >= 0) {
+        close(s->epfd);
+    }
+    if (s->worker_stats != NULL) {
+        munmap(s->worker_stats, s->worker_count * sizeof(uds_stats_t));
+    }
+    while (s->live_config != NULL) {
+        snap = s->live_config;
+        s->live_config = snap->retired;
+        uds_free(snap);
+    }
+    if (s->commands != NULL) {
+        for (i = 0; i < s->commands->count; i++) {
+            if (s->commands->entries[i].owned) {
+                uds_free((void *)s->commands->entries[i].wire);
+            }
+        }
+        uds_free(s->commands);
+    }
+    while (s->retired != NULL) {
+        table = s->retired;
+        s->retired = table->retired;
+        uds_free((void *)table->dropped);
+        uds_free(table);
+    }
+    if (s->snapshot_fd >= 0) {
+        munmap(s->snapshot, s->snapshot_map_size);
+        close(s->snapshot_fd);
+    }
+    munmap(s->shared_config, sizeof(struct uds_config_shared));
+    munmap(s->rate_buckets, UDS_RATE_BUCKETS * sizeof(uds_rate_bucket_t));
+    pthread_mutex_destroy(&s->config_lock);
+    pthread_mutex_destroy(&s->admission.lock);
+    pthread_cond_destroy(&s->admission.cond);
+    pthread_mutex_destroy(&s->multi_pool.lock);
+    pthread_cond_destroy(&s->multi_pool.work);
+    pthread_cond_destroy(&s->multi_pool.done);
+    pthread_mutex_destroy(&s->commands_lock);
+    uds_free(s->readers);
+    uds_free(s->conn);
+    uds_free(s);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      breaker_find
+ *
+ * DESCRIPTION: 
+ *      Find the circuit breaker of a server by its socket path. The lock of
+ *      breakers shall be held.
+ *
+ * PARAMETERS:
+ *      sock_path - The path of unix domain socket
+ *
+ * RETURN:
+ *      The breaker, NULL if not found.
+ ******************************************************************************/
+static uds_breaker_t *breaker_find(const char *sock_path)
+{
+    int i;
+
+    for (i = 0; i < UDS_BREAKER_SLOTS; i++) {
+        if ((breakers[i].path[0] != '\0') &&
+                (strncmp(breakers[i].path, sock_path, UDS_PATH_MAX) == 0)) {
+            return &breakers[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      breaker_get
+ *
+ * DESCRIPTION: 
+ *      Find the circuit breaker of a server by its socket path, or take a
+ *      slot for it, and count the client in it. A slot is free if no client
+ *      uses it and its breaker is closed. The breaker keeps its state while
+ *      open, even if no client uses it.
+ *
+ * PARAMETERS:
+ *      sock_path - The path of unix domain socket
+ *
+ * RETURN:
+ *      The breaker, NULL if no slot is free (the breaker is disabled).
+ *      Release it by breaker_put().
+ ******************************************************************************/
+static uds_breaker_t *breaker_get(const char *sock_path)
+{
+    uds_breaker_t *b;
+    int i;
+
+    if ((sock_path[0] == '\0') || (strlen(sock_path) >= UDS_PATH_MAX)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&breakers_lock);
+    b = breaker_find(sock_path);
+    for (i = 0; (b == NULL) && (i < UDS_BREAKER_SLOTS); i++) {
+        if ((breakers[i].refs == 0) &&
+                (__atomic_load_n(&breakers[i].failures, __ATOMIC_RELAXED) ==
+                    0)) {
+            b = &breakers[i];
+            strcpy(b->path, sock_path);
+            b->open_until = 0;
+            b->rejects = 0;
+        }
+    }
+    if (b != NULL) {
+        b->refs++;
+    }
+    pthread_mutex_unlock(&breakers_lock);
+
+    return b;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      breaker_put
+ *
+ * DESCRIPTION: 
+ *      Release the circuit breaker of a client.
+ *
+ * PARAMETERS:
+ *      b - The breaker, NULL is ignored
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void breaker_put(uds_breaker_t *b)
+{
+    if (b == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&breakers_lock);
+    b->refs--;
+    pthread_mutex_unlock(&breakers_lock);
+}
 
-    /* Find a slot for the connection */
-    for (i = 0; i < UDS_MAX_CLIENT; i++) {
-        if (!s->conn[i].inuse) {
-            break;
-        }
-    }
-    if (i >= UDS_MAX_CLIENT) {
-        printf("Error: too many connections\n");
-        close(cl);
-        return -1;
+
+/******************************************************************************
+ * NAME:
+ *      breaker_allow
+ *
+ * DESCRIPTION: 
+ *      Check if a call to the server can go on. A closed breaker lets all
+ *      calls go. An open one fails them at once, until the cool-down is
+ *      over, then the first call goes as a probe and the next ones wait
+ *      for another cool-down. Lock-free.
+ *
+ * PARAMETERS:
+ *      b   - The breaker, NULL: disabled
+ *      cfg - The configuration of client
+ *
+ * RETURN:
+ *      1 - Allowed, 0 - Failed at once
+ ******************************************************************************/
+static int breaker_allow(uds_breaker_t *b, const uds_client_config_t *cfg)
+{
+    int64_t now, until;
+
+    if ((b == NULL) || (cfg->breaker_threshold <= 0) ||
+            (__atomic_load_n(&b->failures, __ATOMIC_RELAXED) <
+                cfg->breaker_threshold)) {
+        return 1;
     }
 
-    /* Start a new thread to handle the request */
-    sc = &s->conn[i];
-    sc->inuse = 1;
-    sc->client_fd = cl;
-    if (pthread_create(&sc->thread_id, NULL, request_handle_routine, sc) != 0) {
-        perror("pthread_create error");
-        close(cl);
-        sc->inuse = 0;
-        return -1;
+    now = now_ns();
+    until = __atomic_load_n(&b->open_until, __ATOMIC_RELAXED);
+    if ((now >= until) && __atomic_compare_exchange_n(&b->open_until,
+            &until, now + cfg->breaker_cooldown_ms * 1000000LL, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return 1;
     }
 
+    __atomic_add_fetch(&b->rejects, 1, __ATOMIC_RELAXED);
     return 0;
 }
 
 
 /******************************************************************************
  * NAME:
- *      server_close
+ *      breaker_report
  *
  * DESCRIPTION: 
- *      Close the socket fd and free memory.
+ *      Track the result of a call to the server. A success closes the
+ *      breaker, a run of failures opens it for a cool-down.
  *
  * PARAMETERS:
- *      s - A pointer of server info
+ *      b   - The breaker, NULL: disabled
+ *      cfg - The configuration of client
+ *      ok  - 1: the call succeeded, 0: failed
  *
  * RETURN:
  *      None
  ******************************************************************************/
-void server_close(uds_server_t *s)
+static void breaker_report(uds_breaker_t *b, const uds_client_config_t *cfg,
+    int ok)
 {
-    int i;
-
-    printf("Server closing\n");
-
-    if (s == NULL) {
+    if ((b == NULL) || (cfg->breaker_threshold <= 0)) {
         return;
     }
 
-    for (i = 0; i < UDS_MAX_CLIENT; i++) {
-        if (s->conn[i].inuse) {
-            pthread_join(s->conn[i].thread_id, NULL);
-            close(s->conn[i].client_fd);
+    /* Don't write the shared line on every success */
+    if (ok) {
+        if (__atomic_load_n(&b->failures, __ATOMIC_RELAXED) != 0) {
+            __atomic_store_n(&b->failures, 0, __ATOMIC_RELAXED);
         }
+        return;
+    }
+
+    if (__atomic_add_fetch(&b->failures, 1, __ATOMIC_RELAXED) >=
+            cfg->breaker_threshold) {
+        __atomic_store_n(&b->open_until,
+            now_ns() + cfg->breaker_cooldown_ms * 1000000LL,
+            __ATOMIC_RELAXED);
     }
+}
+
 
-    close(s->sockfd);
-    free(s);
+/******************************************************************************
+ * NAME:
+ *      breaker_open
+ *
+ * DESCRIPTION: 
+ *      Check if the breaker is open (or half-open, letting a probe go).
+ *
+ * PARAMETERS:
+ *      b   - The breaker, NULL: disabled
+ *      cfg - The configuration of client
+ *
+ * RETURN:
+ *      1 - Open, 0 - Closed
+ ******************************************************************************/
+static int breaker_open(uds_breaker_t *b, const uds_client_config_t *cfg)
+{
+    return (b != NULL) && (cfg->breaker_threshold > 0) &&
+        (__atomic_load_n(&b->failures, __ATOMIC_RELAXED) >=
+            cfg->breaker_threshold);
 }
 
 
@@ -550,83 +3833,149 @@ void server_close(uds_server_t *s)
  *      client_init
  *
  * DESCRIPTION: 
- *      Init client and connect to the server
+ *      Init client with default configuration and connect to the server
  *
  * PARAMETERS:
- *      sock_path - The path of unix domain socket
+ *      sock_path - The path of unix domain socket, "@name" for an abstract
+ *                  socket address
  *      timeout   - Wait the server to be ready(in seconds)
  *
  * RETURN:
  *      A pointer of client info.
  ******************************************************************************/
 uds_client_t *client_init(const char *sock_path, int timeout)
+{
+    uds_client_config_t cfg;
+
+    client_config_init(&cfg);
+    cfg.connect_timeout = timeout;
+    return client_init_config(sock_path, &cfg);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_init_config
+ *
+ * DESCRIPTION: 
+ *      Init client and connect to the server
+ *
+ * PARAMETERS:
+ *      sock_path - The path of unix domain socket, "@name" for an abstract
+ *                  socket address
+ *      cfg       - The configuration of client
+ *
+ * RETURN:
+ *      A pointer of client info.
+ ******************************************************************************/
+uds_client_t *client_init_config(const char *sock_path,
+    const uds_client_config_t *cfg)
 {
     uds_client_t *sc;
     struct sockaddr_un addr;
-    int fd, rc;
+    socklen_t addr_len;
+    int fd, rc, timeout;
+
+    if ((cfg == NULL) || (cfg->buf_size < sizeof(uds_command_t)) ||
+            (make_sock_addr(sock_path, &addr, &addr_len) != 0)) {
+        printf("Error: invalid parameter!\n");
+        return NULL;
+    }
 
-    sc = (uds_client_t *)malloc(sizeof(uds_client_t));
+    sc = (uds_client_t *)uds_malloc(sizeof(uds_client_t));
     if (sc == NULL) {
         perror("malloc error");
         return NULL;
     }
     memset(sc, 0, sizeof(uds_client_t));
+    sc->config = *cfg;
+
+    /* Fail at once while the server is taken as down */
+    if (cfg->breaker_threshold > 0) {
+        sc->breaker = breaker_get(sock_path);
+    }
+    if (!breaker_allow(sc->breaker, cfg)) {
+        printf("Error: circuit breaker of %s is open\n", sock_path);
+        breaker_put(sc->breaker);
+        uds_free(sc);
+        return NULL;
+    }
+
+    sc->buf = (uint8_t *)uds_malloc(cfg->buf_size);
+    if (sc->buf == NULL) {
+        perror("malloc error");
+        breaker_put(sc->breaker);
+        uds_free(sc);
+        return NULL;
+    }
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strcpy(addr.sun_path, sock_path);
-    fd = socket(AF_UNIX, UDS_SOCK_TYPE, 0);
+    fd = socket(AF_UNIX, cfg->sock_type, 0);
     if (fd < 0) {
         perror("socket error");
-        free(sc);
+        breaker_put(sc->breaker);
+        uds_free(sc->buf);
+        uds_free(sc);
         return NULL;
     }
     sc->sockfd = fd;
 
-    do {
-        rc = connect(sc->sockfd, (struct sockaddr *)&addr, sizeof(addr));
-        if (rc == 0) {
+    /* Retry every second until timeout, no wait after the last try. A
+     * probe of an open breaker tries once, and the others stop waiting
+     * once the breaker opens */
+    timeout = cfg->connect_timeout;
+    while (1) {
+        rc = connect(sc->sockfd, (struct sockaddr *)&addr, addr_len);
+        if ((rc == 0) || (timeout-- <= 0) || breaker_open(sc->breaker, cfg)) {
             break;
-        } else {
-            sleep(1);
         }
-    } while (timeout-- > 0);
+        sleep(1);
+    }
+    breaker_report(sc->breaker, cfg, rc == 0);
     if (rc != 0) {
         perror("connect error");
         close(sc->sockfd);
-        free(sc);
+        breaker_put(sc->breaker);
+        uds_free(sc->buf);
+        uds_free(sc);
         return NULL;
     }
 
+    set_sock_options(sc->sockfd, cfg->recv_timeout, cfg->sndbuf, cfg->rcvbuf);
+
     return sc;
 }
 
 
 /******************************************************************************
  * NAME:
- *      client_send_request
+ *      client_post_request
  *
  * DESCRIPTION: 
- *      Send a request to server, and get the response.
+ *      Send a request to server without waiting for the response. Requests
+ *      can be pipelined, the server answers a connection in order, so the
+ *      responses got by client_recv_response() are in the same order.
  *
  * PARAMETERS:
  *      c   - A pointer of client info
  *      req - The request to send
  *
  * RETURN:
- *      The response for the request. The caller need to free the memory.
+ *      0 - OK, Others - Error
  ******************************************************************************/
-uds_command_t *client_send_request(uds_client_t *c, uds_command_t *req)
+int client_post_request(uds_client_t *c, uds_command_t *req)
 {
-    uint8_t buf[UDS_BUF_SIZE];
     ssize_t bytes, req_len;
 
     if ((c == NULL) || (req == NULL)) {
         printf("Error: invalid parameter!\n");
-        return NULL;
+        return -1;
+    }
+
+    if (!breaker_allow(c->breaker, &c->config)) {
+        printf("Error: circuit breaker of server is open\n");
+        return -1;
     }
 
-    /* Send request */
     req_len = sizeof(uds_command_t) + req->data_len;
     req->signature = UDS_SIGNATURE;
     req->checksum = 0;
@@ -634,31 +3983,163 @@ uds_command_t *client_send_request(uds_client_t *c, uds_command_t *req)
     bytes = send(c->sockfd, req, req_len, MSG_NOSIGNAL);
     if (bytes != req_len) {
         perror("send error");
+        breaker_report(c->breaker, &c->config, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_recv_response
+ *
+ * DESCRIPTION: 
+ *      Receive the response of the oldest request posted on the connection.
+ *
+ * PARAMETERS:
+ *      c - A pointer of client info
+ *
+ * RETURN:
+ *      The response. The caller need to free the memory by uds_free().
+ ******************************************************************************/
+uds_command_t *client_recv_response(uds_client_t *c)
+{
+    uint8_t *buf;
+    ssize_t bytes;
+    int64_t spent;
+
+    if (c == NULL) {
+        printf("Error: invalid parameter!\n");
         return NULL;
     }
 
-    /* Get response */
-    //bytes = recv(c->sockfd, buf, sizeof(buf), 0);
-    bytes = recv_data(c->sockfd, (char *)buf, sizeof(buf), 0);
+    buf = c->buf;
+    if (c->config.busy_poll_us > 0) {
+        if (busy_poll(c->sockfd, c->config.busy_poll_us, &spent)) {
+            c->spin_hits++;
+        } else {
+            c->spin_misses++;
+        }
+        c->spin_ns += spent;
+    }
+    bytes = recv_packet(c->sockfd, (char *)buf, c->config.buf_size,
+                        c->config.sock_type == SOCK_SEQPACKET);
     if (bytes <= 0) {
         printf("Error: receive response error\n");
+        breaker_report(c->breaker, &c->config, 0);
         return NULL;
     }
 
     if (verify_command_packet(buf, bytes)) {
-        uds_command_t *resp = (uds_command_t *)malloc(bytes);
+        uds_command_t *resp = (uds_command_t *)uds_malloc(bytes);
         if (resp) {
             memcpy(resp, buf, bytes);
         } else {
             perror("malloc error");
         }
+        breaker_report(c->breaker, &c->config, 1);
         return resp;
     }
 
+    breaker_report(c->breaker, &c->config, 0);
     return NULL;
 }
 
 
+/******************************************************************************
+ * NAME:
+ *      client_send_request
+ *
+ * DESCRIPTION: 
+ *      Send a request to server, and get the response.
+ *
+ * PARAMETERS:
+ *      c   - A pointer of client info
+ *      req - The request to send
+ *
+ * RETURN:
+ *      The response for the request. The caller need to free the memory by
+ *      uds_free().
+ ******************************************************************************/
+uds_command_t *client_send_request(uds_client_t *c, uds_command_t *req)
+{
+    if (client_post_request(c, req) != 0) {
+        return NULL;
+    }
+
+    return client_recv_response(c);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_send_multi
+ *
+ * DESCRIPTION: 
+ *      Send requests to server in an envelope (UDS_CMD_MULTI), and get the
+ *      response with the sub-responses in the same order, iterate them by
+ *      multi_iter_init() and multi_iter_next(). The envelope shall fit in
+ *      the buffer of server, and the response in the buffer of client.
+ *
+ * PARAMETERS:
+ *      c     - A pointer of client info
+ *      reqs  - The requests to send
+ *      count - Count of the requests
+ *      flags - UDS_MULTI_PARALLEL if the requests can run at the same time
+ *
+ * RETURN:
+ *      The response of envelope. The caller need to free the memory by
+ *      uds_free().
+ ******************************************************************************/
+uds_command_t *client_send_multi(uds_client_t *c, uds_command_t *const reqs[],
+    int count, uint16_t flags)
+{
+    uds_multi_header_t hdr;
+    uds_command_t *env, *resp;
+    size_t len, sub_len;
+    uint8_t *p;
+    int i;
+
+    if ((c == NULL) || (reqs == NULL) || (count < 0) ||
+            (count > UINT16_MAX)) {
+        printf("Error: invalid parameter!\n");
+        return NULL;
+    }
+
+    len = sizeof(uds_command_t) + sizeof(hdr);
+    for (i = 0; i < count; i++) {
+        len += sizeof(uds_command_t) + reqs[i]->data_len;
+    }
+    env = (uds_command_t *)uds_malloc(len);
+    if (env == NULL) {
+        perror("malloc error");
+        return NULL;
+    }
+
+    env->command = UDS_CMD_MULTI;
+    env->data_len = len - sizeof(uds_command_t);
+    hdr.count = (uint16_t)count;
+    hdr.flags = flags;
+    p = (uint8_t *)(env + 1);
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    for (i = 0; i < count; i++) {
+        sub_len = sizeof(uds_command_t) + reqs[i]->data_len;
+        memcpy(p, reqs[i], sub_len);
+        ((uds_command_t *)p)->signature = UDS_SIGNATURE;
+        ((uds_command_t *)p)->checksum = 0;
+        p += sub_len;
+    }
+
+    resp = client_send_request(c, env);
+    uds_free(env);
+
+    return resp;
+}
+
+
 /******************************************************************************
  * NAME:
  *      client_close
@@ -679,5 +4160,170 @@ void client_close(uds_client_t *c)
     }
 
     close(c->sockfd);
-    free(c);
+    breaker_put(c->breaker);
+    uds_free(c->buf);
+    uds_free(c);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_breaker_get
+ *
+ * DESCRIPTION: 
+ *      Get the state of the circuit breaker of a server, e.g. to report it.
+ *
+ * PARAMETERS:
+ *      sock_path - The path of unix domain socket
+ *      b         - Filled with the state of breaker
+ *
+ * RETURN:
+ *      0 - OK, Others - The server has no breaker
+ ******************************************************************************/
+int client_breaker_get(const char *sock_path, uds_breaker_t *b)
+{
+    uds_breaker_t *br;
+
+    if ((sock_path == NULL) || (b == NULL)) {
+        printf("Error: invalid parameter!\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&breakers_lock);
+    br = breaker_find(sock_path);
+    if (br != NULL) {
+        memcpy(b->path, br->path, sizeof(b->path));
+        b->refs = br->refs;
+        b->failures = __atomic_load_n(&br->failures, __ATOMIC_RELAXED);
+        b->open_until = __atomic_load_n(&br->open_until, __ATOMIC_RELAXED);
+        b->rejects = __atomic_load_n(&br->rejects, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&breakers_lock);
+
+    return (br != NULL) ? 0 : -1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_map_snapshot
+ *
+ * DESCRIPTION: 
+ *      Map the snapshot published by server read-only, read it by
+ *      snapshot_version() and snapshot_read() in uds_shm.h. The mapping
+ *      stays valid after the connection is closed, or the server is gone.
+ *
+ * PARAMETERS:
+ *      c - A pointer of client info
+ *
+ * RETURN:
+ *      The snapshot, NULL if the server doesn't publish one. Unmap it by
+ *      client_unmap_snapshot().
+ ******************************************************************************/
+const struct uds_snapshot *client_map_snapshot(uds_client_t *c)
+{
+    uds_command_t req, *resp;
+    uds_snapshot_t *snap;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct stat st;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    ssize_t bytes, more;
+    int fd, seqpacket;
+
+    if (c == NULL) {
+        printf("Error: invalid parameter!\n");
+        return NULL;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.command = UDS_CMD_MAP_SNAPSHOT;
+    if (client_post_request(c, &req) != 0) {
+        return NULL;
+    }
+
+    /* The fd comes with the first byte of the response */
+    seqpacket = (c->config.sock_type == SOCK_SEQPACKET);
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = c->buf;
+    iov.iov_len = seqpacket ? c->config.buf_size : sizeof(uds_command_t);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    bytes = recvmsg(c->sockfd, &msg,
+        MSG_CMSG_CLOEXEC | (seqpacket ? 0 : MSG_WAITALL));
+    fd = -1;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) &&
+                (cmsg->cmsg_type == SCM_RIGHTS)) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    resp = (uds_command_t *)c->buf;
+    if ((bytes == sizeof(uds_command_t)) && !seqpacket &&
+            (resp->data_len > 0) &&
+            (resp->data_len <= c->config.buf_size - sizeof(uds_command_t))) {
+        more = recv_full(c->sockfd, (char *)(resp + 1), resp->data_len);
+        bytes = (more > 0) ? bytes + more : -1;
+    }
+    if ((bytes <= 0) || !verify_command_packet(resp, bytes) ||
+            (resp->status != STATUS_SUCCESS) || (fd < 0)) {
+        printf("Error: map snapshot error\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(*snap))) {
+        printf("Error: invalid snapshot\n");
+        close(fd);
+        return NULL;
+    }
+    snap = (uds_snapshot_t *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+        fd, 0);
+    close(fd);
+    if (snap == MAP_FAILED) {
+        perror("mmap error");
+        return NULL;
+    }
+    if ((snap->magic != UDS_SNAPSHOT_MAGIC) ||
+            (sizeof(*snap) + (off_t)snap->size > st.st_size)) {
+        printf("Error: invalid snapshot\n");
+        munmap(snap, st.st_size);
+        return NULL;
+    }
+
+    return snap;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_unmap_snapshot
+ *
+ * DESCRIPTION: 
+ *      Unmap a snapshot mapped by client_map_snapshot().
+ *
+ * PARAMETERS:
+ *      snap - The snapshot
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void client_unmap_snapshot(const struct uds_snapshot *snap)
+{
+    if (snap == NULL) {
+        return;
+    }
+
+    /* The length is rounded up to pages as it was mapped */
+    munmap((void *)snap, sizeof(*snap) + snap->size);
 }
@@ -19,30 +19,85 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 
 /*--------------------------------------------------------------
  * Definition for both client and server
  *--------------------------------------------------------------*/
 
-/* The socket type we used */
+/* The default socket type we used (see sock_type of configuration) */
 #define UDS_SOCK_TYPE           SOCK_STREAM
 //#define UDS_SOCK_TYPE         SOCK_SEQPACKET
 
 
-/* The read/write buffer size of socket */
+/* The default read/write buffer size of socket */
 #define UDS_BUF_SIZE            1024
 
 /* The signature of the request/response packet */
 #define UDS_SIGNATURE           0xDEADBEEF
 
+/* A socket path starts with '@' is in Linux abstract namespace */
+#define UDS_IS_ABSTRACT(path)   ((path)[0] == '@')
+
 /* Make a structure 1-byte aligned */
 #define BYTE_ALIGNED            __attribute__((packed))
 
+/* Size of CPU cache line, the data written by different threads shall not
+ * share a line */
+#define UDS_CACHE_LINE          64
+
+/* Make a structure start on and fill whole cache lines */
+#define CACHE_ALIGNED           __attribute__((aligned(UDS_CACHE_LINE)))
+
+
+/* Status code, the values used in struct uds_command_t.status. Codes set
+ * by the library take the top of range, applications define theirs after
+ * STATUS_ERROR */
+#define STATUS_SUCCESS      0           /* Success */
+#define STATUS_ERROR        1           /* Generic error */
+#define STATUS_BUSY         0xFFFF0001  /* Server is overloaded, retry later */
+
+
+/* Commands handled by the library on admin listeners, the data of request
+ * and response are text of "key = value" lines */
+#define UDS_CMD_SET_CONFIG  0xFFFF0001  /* Change the configuration */
+#define UDS_CMD_GET_CONFIG  0xFFFF0002  /* Get the configuration */
 
-/* Status code, the values used in struct uds_command_t.status */
-#define STATUS_SUCCESS      0   /* Success */
-#define STATUS_ERROR        1   /* Generic error */
+/* Envelope of sub-requests handled in one dispatch, on any listener. The
+ * payload is a uds_multi_header_t, then the sub-packets back to back, each
+ * a uds_command_t (signature and checksum are not used) and its data. The
+ * response is an envelope of the sub-responses in the same order */
+#define UDS_CMD_MULTI       0xFFFF0003
+
+/* Flags of an envelope */
+#define UDS_MULTI_PARALLEL  0x0001  /* Sub-requests can run at the same time */
+
+/* Map the snapshot published by server, on any listener. The response has
+ * no data, the fd of the snapshot comes with it (SCM_RIGHTS) */
+#define UDS_CMD_MAP_SNAPSHOT    0xFFFF0004
+
+/* Snapshot of read-mostly data in a shared mapping, see uds_shm.h */
+struct uds_snapshot;
+
+
+/* Alignment of the memory returned by uds_malloc() */
+#define UDS_ALLOC_ALIGN     16
+
+/* Allocator of the library. All memory of the library, the responses
+ * returned by request handlers and by client_send_request() come from it,
+ * the default one is malloc()/free() */
+typedef struct uds_allocator {
+    void *(*alloc)(void *ctx, size_t size, size_t align);  /* NULL: failed */
+    void (*free)(void *ctx, void *ptr);
+    void *ctx;                  /* Passed to alloc() and free() */
+} uds_allocator_t;
 
 
 /* Common header of both request/response packets */
@@ -58,52 +113,418 @@ typedef struct uds_command {
 } BYTE_ALIGNED uds_command_t;
 
 
+/* Header of the payload of an envelope */
+typedef struct uds_multi_header {
+    uint16_t count;             /* Count of sub-packets */
+    uint16_t flags;             /* UDS_MULTI_*, 0 in responses */
+} BYTE_ALIGNED uds_multi_header_t;
+
+/* Iterate the sub-packets of an envelope */
+typedef struct uds_multi_iter {
+    const uint8_t *next;        /* The next sub-packet */
+    uint16_t left;              /* Count of sub-packets not iterated */
+    uint16_t flags;             /* Flags of the envelope */
+} uds_multi_iter_t;
+
+
+void uds_set_allocator(const uds_allocator_t *allocator);
+void *uds_malloc(size_t size);
+void uds_free(void *ptr);
+
+int multi_iter_init(uds_multi_iter_t *it, const uds_command_t *pkt);
+const uds_command_t *multi_iter_next(uds_multi_iter_t *it);
+
+
 /*--------------------------------------------------------------
  * Definition for client only
  *--------------------------------------------------------------*/
 
+/* Default failures in a row to open the circuit breaker of a server */
+#define UDS_BREAKER_THRESHOLD   5
+
+/* Default cool-down of an open circuit breaker before a probe(ms) */
+#define UDS_BREAKER_COOLDOWN_MS 1000
+
+/* Count of circuit breakers of a process */
+#define UDS_BREAKER_SLOTS       64
+
+/* Size of the socket path of a server (sun_path in struct sockaddr_un) */
+#define UDS_PATH_MAX            108
+
+/* Circuit breaker of a server, shared by the clients of a process */
+typedef struct uds_breaker {
+    char path[UDS_PATH_MAX];    /* Socket path of the server */
+    int refs;                   /* Clients using it, the slot can be reused
+                                   when no client uses it and it is closed */
+    int failures;               /* Failures in a row, open at threshold */
+    int64_t open_until;         /* Calls fail at once until then(ns), the
+                                   first one after it is the probe */
+    uint64_t rejects;           /* Calls failed at once */
+} uds_breaker_t;
+
+/* Runtime configuration of client */
+typedef struct uds_client_config {
+    int sock_type;          /* SOCK_STREAM or SOCK_SEQPACKET */
+    size_t buf_size;        /* Size of the buffer to receive response */
+    int connect_timeout;    /* Wait the server to be ready(in seconds) */
+    int recv_timeout;       /* Timeout of waiting response(ms), 0: forever */
+    int sndbuf;             /* SO_SNDBUF of socket, 0: system default */
+    int rcvbuf;             /* SO_RCVBUF of socket, 0: system default */
+    int busy_poll_us;       /* Spin for the response before blocking(us),
+                               0: disable */
+    int breaker_threshold;  /* Failures in a row to open the circuit
+                               breaker, 0: disable */
+    int breaker_cooldown_ms;    /* Fail at once for it before a probe(ms) */
+} uds_client_config_t;
+
 /* Keep the information of client */
 typedef struct uds_client {
-    int sockfd;         /* Socket fd of the client */
+    int sockfd;                 /* Socket fd of the client */
+    uint8_t *buf;               /* Buffer to receive response */
+    uds_client_config_t config; /* Configuration of the client */
+    uds_breaker_t *breaker;     /* Circuit breaker of the server, or NULL */
+    uint64_t spin_hits;         /* Responses arrived while spinning */
+    uint64_t spin_misses;       /* Spins ended without response */
+    uint64_t spin_ns;           /* Time spent in spinning(ns) */
 } uds_client_t;
 
 
+void client_config_init(uds_client_config_t *cfg);
+int client_config_load_env(uds_client_config_t *cfg);
+int client_config_load_file(uds_client_config_t *cfg, const char *path);
+
 uds_client_t *client_init(const char *sock_path, int timeout);
+uds_client_t *client_init_config(const char *sock_path,
+    const uds_client_config_t *cfg);
 uds_command_t *client_send_request(uds_client_t *c, uds_command_t *req);
+int client_post_request(uds_client_t *c, uds_command_t *req);
+uds_command_t *client_recv_response(uds_client_t *c);
+uds_command_t *client_send_multi(uds_client_t *c, uds_command_t *const reqs[],
+    int count, uint16_t flags);
 void client_close(uds_client_t *s);
+int client_breaker_get(const char *sock_path, uds_breaker_t *b);
+const struct uds_snapshot *client_map_snapshot(uds_client_t *c);
+void client_unmap_snapshot(const struct uds_snapshot *snap);
 
 
 /*--------------------------------------------------------------
  * Definition for server only
  *--------------------------------------------------------------*/
 
-/* The maximum length of the queue of pending connections */
+/* The default maximum length of the queue of pending connections */
 #define UDS_MAX_BACKLOG     10
 
-/* The maxium count of client connected */
+/* The first fd passed in by service manager (socket activation) */
+#define UDS_LISTEN_FDS_START    3
+
+/* The default maxium count of client connected */
 #define UDS_MAX_CLIENT      10
 
+/* The maxium count of listening sockets of a server */
+#define UDS_MAX_LISTENER    4
+
+/* The maxium count of worker processes in pre-fork mode */
+#define UDS_MAX_WORKER      64
+
+/* The interval of master checking workers in pre-fork mode(ms) */
+#define UDS_PREFORK_POLL_MS 100
+
+/* Default CoDel parameters of admission control */
+#define UDS_QUEUE_TARGET_MS     5
+#define UDS_QUEUE_INTERVAL_MS   100
+
+/* Peer identity for rate limiting, from SO_PEERCRED */
+#define UDS_RATE_KEY_UID    0   /* All processes of a user share the limit */
+#define UDS_RATE_KEY_PID    1   /* Each process has its own limit */
+
+/* The count of rate limiting buckets, shall be power of 2 */
+#define UDS_RATE_BUCKETS    1024
+
+/* Max buckets probed to find the bucket of a peer */
+#define UDS_RATE_PROBES     8
+
+/* Default burst of rate limiting */
+#define UDS_RATE_BURST      10
+
+/* Default lower bound of adaptive socket buffers */
+#define UDS_SOCKBUF_MIN     8192
+
+/* Messages kept in flight by an adaptive socket buffer */
+#define UDS_SOCKBUF_MSGS    4
+
+/* The default and the upper bound of threads running the sub-requests of a
+ * parallel envelope */
+#define UDS_MULTI_THREADS       4
+#define UDS_MAX_MULTI_THREADS   64
+
+/* Max length of the CPU list in configuration */
+#define UDS_CPU_LIST_LEN    64
+
+/* Log level of server */
+#define UDS_LOG_ERROR       0   /* Only errors */
+#define UDS_LOG_INFO        1   /* Slow requests, worker restarts */
+#define UDS_LOG_DEBUG       2   /* Every request */
+
+/* The way server handles connections */
+#define UDS_ENGINE_THREAD   0   /* A thread per connection */
+#define UDS_ENGINE_PREFORK  1   /* Worker processes, a thread per connection */
+
+/* Request handler, returns a response allocated by uds_malloc(), the
+ * library frees it after sending */
 typedef uds_command_t * (*request_handler_t) (uds_command_t *);
 
-/* Keep the information of connection */
+/* Request handler with a user context, e.g. a C++ object */
+typedef uds_command_t * (*request_handler_ctx_t) (void *ctx, uds_command_t *);
+
+/* Runtime configuration of server */
+typedef struct uds_server_config {
+    int sock_type;          /* SOCK_STREAM or SOCK_SEQPACKET */
+    size_t buf_size;        /* Size of the buffer to receive request */
+    int backlog;            /* Max length of the queue of pending connections */
+    int max_client;         /* Max count of connections (and their threads) */
+    int engine;             /* UDS_ENGINE_THREAD or UDS_ENGINE_PREFORK */
+    int workers;            /* Count of worker processes in pre-fork mode */
+    size_t stack_size;      /* Stack size of connection threads, 0: default */
+    int recv_timeout;       /* Close the idle connection(ms), 0: never */
+    int sndbuf;             /* SO_SNDBUF of connections, 0: system default */
+    int rcvbuf;             /* SO_RCVBUF of connections, 0: system default */
+    int log_level;          /* UDS_LOG_ERROR, UDS_LOG_INFO or UDS_LOG_DEBUG */
+    int slow_request_ms;    /* Log the request slower than it, 0: disable */
+    int max_inflight;       /* Max requests handled at the same time, the
+                               others wait in queue, 0: no admission control */
+    int queue_limit;        /* Max requests waiting in queue, 0: no limit */
+    int queue_target_ms;    /* Acceptable queue delay (CoDel target) */
+    int queue_interval_ms;  /* Window of queue delay above target before
+                               rejecting requests (CoDel interval) */
+    int rate_limit;         /* Max requests per second of a peer, 0: no limit */
+    int rate_burst;         /* Max requests of a peer in a burst */
+    int rate_key;           /* Peer identity, UDS_RATE_KEY_UID or _PID */
+    char cpu_list[UDS_CPU_LIST_LEN];    /* CPUs to run connection threads,
+                                           e.g. "0-3,8", "": no affinity */
+    int numa_follow_peer;   /* 1: run connection thread on the NUMA node
+                               where the peer process runs */
+    int busy_poll_us;       /* Spin for the next request before blocking(us),
+                               0: disable */
+    size_t sockbuf_min;     /* Lower bound of adaptive socket buffers */
+    size_t sockbuf_max;     /* Upper bound of adaptive socket buffers,
+                               0: use sndbuf/rcvbuf as is */
+    int multi_threads;      /* Max threads running a parallel envelope,
+                               1: in order */
+    size_t snapshot_size;   /* Capacity of the snapshot published to
+                               clients, 0: disable */
+    int snapshot_unsealed;  /* 1: publish the snapshot even if it can't be
+                               sealed against writes of clients */
+} uds_server_config_t;
+
+/* The policy of a listener */
+typedef struct uds_listener_attr {
+    int max_client;             /* Max connections on it, 0: max_client of
+                                   the server configuration */
+    int priority;               /* Nice value of its connection threads */
+    size_t stack_size;          /* Stack size of its threads, 0: default */
+    int admin;                  /* 1: accept UDS_CMD_SET_CONFIG and so on */
+} uds_listener_attr_t;
+
+/* Keep the information of listener */
+typedef struct uds_listener {
+    int sockfd;                 /* Listening socket fd */
+    int nconn;                  /* Count of connections accepted on it */
+    uds_listener_attr_t attr;   /* The policy of the listener */
+} uds_listener_t;
+
+/* State of a connection slot */
+#define UDS_CONN_FREE       0   /* The slot is free */
+#define UDS_CONN_BUSY       1   /* The slot is taken by a connection */
+
+/* State of a connection written by its thread for every request. It is
+ * allocated by the thread on its own node, with the receive buffer after
+ * it, so the lines it writes are not shared with other connections */
+typedef struct uds_connect_hot {
+    uint8_t *buf;               /* Receive buffer of the connection */
+    size_t buf_size;            /* Size of the receive buffer */
+    uint32_t avg_req;           /* Recent size of requests, peak follows */
+    uint32_t avg_resp;          /* Recent size of responses, peak follows */
+    int rcvbuf;                 /* SO_RCVBUF set adaptively, 0: not set */
+    int sndbuf;                 /* SO_SNDBUF set adaptively, 0: not set */
+} CACHE_ALIGNED uds_connect_hot_t;
+
+/* Slot of a connection. It is set by the accepting thread, then read only
+ * until the connection is released. Slots don't share cache lines */
 typedef struct uds_connect {
-    int inuse;                  /* 1: the connection structure is in-use; 0: free */
+    int state;                  /* UDS_CONN_*, changed by atomic operations */
     int client_fd;              /* Socket fd of the connection */
     pthread_t thread_id;        /* The thread id of request handler */
     struct uds_server *serv;    /* The pointer of uds_server who own the connection */
-} uds_connect_t;
+    uds_listener_t *listener;   /* The listener who accept the connection */
+    pid_t peer_pid;             /* Process id of peer (SO_PEERCRED) */
+    uid_t peer_uid;             /* User id of peer */
+    gid_t peer_gid;             /* Group id of peer */
+    struct uds_rate_bucket *rate;   /* Rate limiting bucket of peer */
+    uds_connect_hot_t *hot;     /* Set by the thread of connection */
+} CACHE_ALIGNED uds_connect_t;
+
+/* Rate limiting bucket of a peer, checked with GCRA (equivalent to token
+ * bucket) by a single compare-and-swap. It is freed when the last
+ * connection using it is closed */
+typedef struct uds_rate_bucket {
+    uint64_t owner;             /* Peer uid/pid + 1 in high 32 bits, count of
+                                   connections in low 32 bits, 0: free */
+    int64_t tat;                /* Theoretical arrival time(ns) */
+} uds_rate_bucket_t;
+
+/* State of admission control, requests exceed the capacity of server are
+ * rejected with STATUS_BUSY, the way like CoDel */
+typedef struct uds_admission {
+    pthread_mutex_t lock;       /* Lock of the state */
+    pthread_cond_t cond;        /* Signaled when a request is done */
+    int inflight;               /* Requests being handled */
+    int waiting;                /* Requests waiting in queue */
+    int dropping;               /* 1: queue delay is above target too long */
+    int64_t first_above;        /* When queue delay can be above target until
+                                   entering dropping state(ns), 0: below */
+    int64_t drop_next;          /* When to reject next request(ns) */
+    uint32_t drop_count;        /* Requests rejected in dropping state */
+} uds_admission_t;
+
+/* Threads helping connection threads to run parallel envelopes, started on
+ * demand by the process running them and kept until server_close() */
+typedef struct uds_multi_pool {
+    pthread_mutex_t lock;       /* Lock of the pool */
+    pthread_cond_t work;        /* Signaled when an envelope is queued */
+    pthread_cond_t done;        /* Signaled when a helper leaves an envelope */
+    struct multi_batch *queue;  /* Envelopes waiting for helpers */
+    pthread_t tid[UDS_MAX_MULTI_THREADS];   /* The helper threads */
+    int nthread;                /* Count of helper threads */
+    int stop;                   /* 1: the helpers shall exit */
+} uds_multi_pool_t;
+
+/* A command of the server: a response which is the same on every call,
+ * encoded once, or a handler of its own */
+typedef struct uds_command_entry {
+    uint32_t command;           /* The request type it answers */
+    const uds_command_t *wire;  /* The packet with signature and checksum,
+                                   NULL: call the handler */
+    int owned;                  /* 1: wire is allocated by the library */
+    request_handler_ctx_t handler;  /* Handler of the command */
+    void *ctx;                  /* The context passed to the handler */
+} uds_command_entry_t;
+
+/* Table of commands, never changed once published. An update publishes a
+ * new table (RCU), the old one is retired and freed when no request can
+ * use it any more */
+typedef struct uds_command_table {
+    uds_command_entry_t *entries;       /* Sorted by command, after it */
+    int count;                          /* Count of entries */
+    uint64_t retire_epoch;              /* Epoch when it was retired */
+    const uds_command_t *dropped;       /* Wire of the entry replaced by the
+                                           newer table, freed with it */
+    struct uds_command_table *retired;  /* Older retired table */
+} uds_command_table_t;
+
+/* Epoch of a connection thread, the epoch of server when its request
+ * started, 0: not handling a request. It has its own cache line */
+typedef struct uds_reader_epoch {
+    uint64_t epoch;
+} CACHE_ALIGNED uds_reader_epoch_t;
+
+/* Statistics of server */
+typedef struct uds_stats {
+    uint64_t connections;       /* Connections accepted */
+    uint64_t rejected;          /* Connections rejected by limits */
+    uint64_t requests;          /* Requests handled */
+    uint64_t errors;            /* Invalid requests and send errors */
+    uint64_t worker_restarts;   /* Workers restarted in pre-fork mode */
+    uint64_t slow_requests;     /* Requests slower than slow_request_ms */
+    uint64_t busy;              /* Requests rejected with STATUS_BUSY */
+    uint64_t rate_limited;      /* Requests rejected by rate limiting */
+    uint64_t spin_hits;         /* Requests arrived while spinning */
+    uint64_t spin_misses;       /* Spins ended without request */
+    uint64_t spin_ns;           /* Time spent in spinning(ns) */
+    uint64_t sockbuf_resizes;   /* Adaptive socket buffer changes */
+    uint64_t sndbuf_bytes;      /* SO_SNDBUF of open connections(adaptive) */
+    uint64_t rcvbuf_bytes;      /* SO_RCVBUF of open connections(adaptive) */
+    uint64_t envelopes;         /* UDS_CMD_MULTI requests handled */
+    uint64_t sub_requests;      /* Sub-requests in the envelopes */
+} uds_stats_t;
 
 /* Keep the information of server */
 typedef struct uds_server {
-    int sockfd;                         /* Socket fd of the server */
-    uds_connect_t conn[UDS_MAX_CLIENT]; /* Connections managed by server */
+    uds_listener_t listener[UDS_MAX_LISTENER];  /* Listening sockets */
+    int listener_count;                 /* Count of listeners */
+    int last_listener;                  /* The listener accepted last time */
+    uds_connect_t *conn;                /* Connections managed by server */
     request_handler_t request_handler;  /* Function pointer of the request handle */
+    request_handler_ctx_t handler_ctx_fn;   /* Handler with context, used
+                                               instead if set */
+    void *handler_ctx;                  /* The context of handler_ctx_fn */
+    int epfd;                           /* Epoll fd to wait for listeners */
+    uds_stats_t *stats;                 /* Statistics of this process */
+    uds_stats_t local_stats;            /* Statistics of non-worker process */
+    uds_stats_t *worker_stats;          /* Statistics shared by workers */
+    int worker_count;                   /* Count of workers in pre-fork mode */
+    int worker_id;                      /* Index of this worker, -1: not a
+                                           pre-forked worker */
+    int nconn;                          /* Count of connections */
+    uds_server_config_t config;         /* Configuration at init, the sizes
+                                           of connections and buffers */
+    struct uds_config_shared *shared_config;   /* Live configuration shared
+                                                  by all processes */
+    struct uds_config_snapshot *live_config;   /* Live configuration of this
+                                                  process, read without lock */
+    pthread_mutex_t config_lock;        /* Lock to update live_config */
+    uds_admission_t admission;          /* State of admission control */
+    uds_multi_pool_t multi_pool;        /* Helpers of parallel envelopes */
+    uds_rate_bucket_t *rate_buckets;    /* Rate limiting buckets shared by
+                                           all processes */
+    uds_command_table_t *commands;      /* Commands, read without lock */
+    uds_command_table_t *retired;       /* Tables waiting to be freed */
+    pthread_mutex_t commands_lock;      /* Serializes updates of commands */
+    uint64_t epoch;                     /* Bumped by each update, from 1 */
+    uds_reader_epoch_t *readers;        /* Epoch of each connection slot */
+    int membarrier;                     /* 1: updates make the readers run a
+                                           barrier by membarrier() */
+    struct uds_snapshot *snapshot;      /* Snapshot published to clients,
+                                           shared by all processes */
+    int snapshot_fd;                    /* Memfd of the snapshot, -1: none */
+    size_t snapshot_map_size;           /* Size of the snapshot mapping */
 } uds_server_t;
 
 
+void server_config_init(uds_server_config_t *cfg);
+int server_config_load_env(uds_server_config_t *cfg);
+int server_config_load_file(uds_server_config_t *cfg, const char *path);
+int server_config_update(uds_server_config_t *cfg, const char *text,
+    int live_only);
+size_t server_config_dump(const uds_server_config_t *cfg, char *buf,
+    size_t len);
+
 uds_server_t *server_init(const char *sock_path, request_handler_t req_handler);
+uds_server_t *server_init_config(const char *sock_path,
+    request_handler_t req_handler, const uds_server_config_t *cfg);
+void server_set_handler_ctx(uds_server_t *s, request_handler_ctx_t handler,
+    void *ctx);
+int server_set_const_response(uds_server_t *s, uint32_t command,
+    uint32_t status, const void *data, uint32_t len);
+int server_set_static_response(uds_server_t *s, uint32_t command,
+    const uds_command_t *wire);
+int server_register_command(uds_server_t *s, uint32_t command,
+    request_handler_ctx_t handler, void *ctx);
+int server_unregister_command(uds_server_t *s, uint32_t command);
+void server_synchronize(uds_server_t *s);
+int server_add_listener(uds_server_t *s, const char *sock_path,
+    const uds_listener_attr_t *attr);
 int server_accept_request(uds_server_t *s);
+int server_prefork(uds_server_t *s, int nworkers,
+    volatile sig_atomic_t *run_flag);
+int server_run(uds_server_t *s, volatile sig_atomic_t *run_flag);
+int server_reconfigure(uds_server_t *s, const char *text);
+int server_publish_snapshot(uds_server_t *s, const void *data, size_t len);
+void server_get_stats(uds_server_t *s, uds_stats_t *stats);
 void server_close(uds_server_t *s);
 
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _UDS_H_ */
@@ -0,0 +1,685 @@
+/******************************************************************************
+*
+* FILENAME:
+*     uds.hpp
+*
+* DESCRIPTION:
+*     Header-only C++17 wrapper of the Unix domain socket library. The
+*     server and client own their C structures (RAII, move-only), payloads
+*     are exposed as span views, and a handler is any callable, called
+*     through a function pointer without std::function.
+*
+* REVISION(MM/DD/YYYY):
+*     10/18/2026
+*     - Initial version
+*
+******************************************************************************/
+#ifndef _UDS_HPP_
+#define _UDS_HPP_
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if (__cplusplus >= 202002L) && __has_include(<span>)
+#include <span>
+#endif
+#include "uds.h"
+
+
+namespace uds {
+
+/*--------------------------------------------------------------
+ * Memory
+ *--------------------------------------------------------------*/
+
+namespace detail {
+
+/* Memory resource of the allocator of the library (uds_malloc) */
+class library_resource : public std::pmr::memory_resource {
+private:
+    void *do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        if (align <= UDS_ALLOC_ALIGN) {
+            void *p = uds_malloc(bytes);
+            if (p == nullptr) {
+                throw std::bad_alloc();
+            }
+            return p;
+        }
+
+        /* Over-align by hand, keep the pointer to free before the block */
+        auto *p = static_cast<std::uint8_t *>(uds_malloc(bytes + align));
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        auto *q = reinterpret_cast<std::uint8_t *>(
+            (reinterpret_cast<std::uintptr_t>(p) + align) & ~(align - 1));
+        std::memcpy(q - sizeof(void *), &p, sizeof(void *));
+        return q;
+    }
+
+    void do_deallocate(void *p, std::size_t, std::size_t align) override
+    {
+        if (align > UDS_ALLOC_ALIGN) {
+            std::memcpy(&p, static_cast<std::uint8_t *>(p) - sizeof(void *),
+                        sizeof(void *));
+        }
+        uds_free(p);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &o) const noexcept
+        override
+    {
+        return this == &o;
+    }
+};
+
+/* Header kept before the memory given to the library by a resource */
+struct alignas(UDS_ALLOC_ALIGN) resource_header {
+    std::size_t size;           /* Bytes allocated, header included */
+    std::size_t align;          /* Alignment of the allocation */
+};
+
+inline void *resource_alloc(void *ctx, std::size_t size, std::size_t align)
+    noexcept
+{
+    auto *r = static_cast<std::pmr::memory_resource *>(ctx);
+    std::size_t head = sizeof(resource_header);
+
+    if (align > head) {
+        head = align;
+    }
+    try {
+        auto *p = static_cast<std::uint8_t *>(r->allocate(head + size,
+            (align > alignof(resource_header)) ? align :
+            alignof(resource_header)));
+        auto *h = reinterpret_cast<resource_header *>(p + head) - 1;
+        h->size = head + size;
+        h->align = align;
+        return p + head;
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+inline void resource_free(void *ctx, void *ptr) noexcept
+{
+    auto *r = static_cast<std::pmr::memory_resource *>(ctx);
+    auto *h = static_cast<resource_header *>(ptr) - 1;
+    std::size_t align = (h->align > alignof(resource_header)) ? h->align :
+        alignof(resource_header);
+    std::size_t head = (h->align > sizeof(resource_header)) ? h->align :
+        sizeof(resource_header);
+
+    r->deallocate(static_cast<std::uint8_t *>(ptr) - head, h->size, align);
+}
+
+} // namespace detail
+
+/* The allocator of the library as a memory resource, the containers of
+ * this wrapper use it */
+inline std::pmr::memory_resource *library_resource() noexcept
+{
+    static detail::library_resource r;
+    return &r;
+}
+
+/* Let the library allocate from a memory resource, e.g. a
+ * std::pmr::unsynchronized_pool_resource or an arena. Call it before any
+ * server or client is created; the resource shall outlive them, and be
+ * thread-safe if the server is. nullptr restores malloc()/free() */
+inline void use_memory_resource(std::pmr::memory_resource *r) noexcept
+{
+    uds_allocator_t a;
+
+    if ((r == nullptr) || (r == library_resource())) {
+        uds_set_allocator(nullptr);
+        return;
+    }
+    a.alloc = detail::resource_alloc;
+    a.free = detail::resource_free;
+    a.ctx = r;
+    uds_set_allocator(&a);
+}
+
+
+/*--------------------------------------------------------------
+ * Views of packets
+ *--------------------------------------------------------------*/
+
+#if defined(__cpp_lib_span)
+template <class T>
+using span = std::span<T>;
+#else
+/* The subset of std::span used by this library, for C++17 */
+template <class T>
+class span {
+public:
+    constexpr span() noexcept : data_(nullptr), size_(0) {}
+    constexpr span(T *data, std::size_t size) noexcept
+        : data_(data), size_(size) {}
+    template <std::size_t N>
+    constexpr span(T (&arr)[N]) noexcept : data_(arr), size_(N) {}
+    template <class C, class = std::enable_if_t<std::is_convertible_v<
+        decltype(std::declval<C &>().data()), T *>>>
+    constexpr span(C &&c) noexcept : data_(c.data()), size_(c.size()) {}
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T *begin() const noexcept { return data_; }
+    constexpr T *end() const noexcept { return data_ + size_; }
+    constexpr T &operator[](std::size_t i) const noexcept { return data_[i]; }
+    constexpr span subspan(std::size_t offset) const noexcept
+    {
+        return span(data_ + offset, size_ - offset);
+    }
+
+private:
+    T *data_;
+    std::size_t size_;
+};
+#endif
+
+/* A read-only view of payload */
+using bytes = span<const std::uint8_t>;
+
+/* A packet type of common.h style: starts with uds_command_t, packed */
+template <class T>
+inline constexpr bool is_packet_v = std::is_standard_layout_v<T> &&
+    std::is_trivially_copyable_v<T> && (alignof(T) == 1) &&
+    (sizeof(T) >= sizeof(uds_command_t));
+
+namespace detail {
+
+/* Accessors shared by requests and responses, D::get() gives the packet */
+template <class D>
+class packet_view {
+public:
+    /* Payload following the header */
+    bytes payload() const noexcept
+    {
+        const uds_command_t *p = pkt();
+        return bytes(reinterpret_cast<const std::uint8_t *>(p + 1),
+                     p->data_len);
+    }
+
+    /* The whole packet as a packed structure, nullptr if it is too short */
+    template <class T>
+    const T *as() const noexcept
+    {
+        static_assert(is_packet_v<T>, "T shall be a packed packet type");
+        const uds_command_t *p = pkt();
+        if (sizeof(uds_command_t) + p->data_len < sizeof(T)) {
+            return nullptr;
+        }
+        return reinterpret_cast<const T *>(p);
+    }
+
+    /* Copy the payload into a trivially copyable value */
+    template <class T>
+    bool read(T &out) const noexcept
+    {
+        static_assert(std::is_trivially_copyable_v<T>,
+                      "T shall be trivially copyable");
+        bytes b = payload();
+        if (b.size() < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(&out, b.data(), sizeof(T));
+        return true;
+    }
+
+private:
+    const uds_command_t *pkt() const noexcept
+    {
+        return static_cast<const D *>(this)->get();
+    }
+};
+
+} // namespace detail
+
+
+/* A request received by the server, valid during the handler call */
+class Request : public detail::packet_view<Request> {
+public:
+    explicit Request(const uds_command_t *pkt) noexcept : pkt_(pkt) {}
+
+    std::uint32_t command() const noexcept { return pkt_->command; }
+    const uds_command_t *get() const noexcept { return pkt_; }
+
+private:
+    const uds_command_t *pkt_;
+};
+
+
+/* A response owned in the memory of uds_malloc() */
+class Response : public detail::packet_view<Response> {
+public:
+    Response() noexcept : pkt_(nullptr) {}
+    explicit Response(uds_command_t *pkt) noexcept : pkt_(pkt) {}
+    Response(Response &&o) noexcept : pkt_(o.release()) {}
+    Response &operator=(Response &&o) noexcept
+    {
+        reset(o.release());
+        return *this;
+    }
+    Response(const Response &) = delete;
+    Response &operator=(const Response &) = delete;
+    ~Response() { uds_free(pkt_); }
+
+    /* Build a response with a status and a copy of payload. It is empty if
+     * out of memory, the server answers STATUS_ERROR then */
+    static Response make(std::uint32_t status, bytes payload = bytes())
+    {
+        std::size_t len = sizeof(uds_command_t) + payload.size();
+        auto *p = static_cast<uds_command_t *>(uds_malloc(len));
+        if (p != nullptr) {
+            std::memset(p, 0, sizeof(uds_command_t));
+            p->status = status;
+            p->data_len = static_cast<std::uint32_t>(payload.size());
+            if (!payload.empty()) {
+                std::memcpy(p + 1, payload.data(), payload.size());
+            }
+        }
+        return Response(p);
+    }
+
+    /* Build a response with a trivially copyable value as payload */
+    template <class T>
+    static Response make_value(std::uint32_t status, const T &value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>,
+                      "T shall be trivially copyable");
+        return make(status, bytes(reinterpret_cast<const std::uint8_t *>(
+            &value), sizeof(T)));
+    }
+
+    explicit operator bool() const noexcept { return pkt_ != nullptr; }
+    std::uint32_t status() const noexcept { return pkt_->status; }
+    const uds_command_t *get() const noexcept { return pkt_; }
+
+    uds_command_t *release() noexcept
+    {
+        uds_command_t *p = pkt_;
+        pkt_ = nullptr;
+        return p;
+    }
+
+    void reset(uds_command_t *p = nullptr) noexcept
+    {
+        uds_free(pkt_);
+        pkt_ = p;
+    }
+
+private:
+    uds_command_t *pkt_;
+};
+
+
+/* A request with a fixed body, built on the stack and sent without copy */
+template <class Body>
+struct BYTE_ALIGNED Packet {
+    static_assert(std::is_trivially_copyable_v<Body>,
+                  "Body shall be trivially copyable");
+
+    uds_command_t common;
+    Body body;
+
+    explicit Packet(std::uint32_t command, const Body &b = Body()) noexcept
+    {
+        std::memset(&common, 0, sizeof(common));
+        common.command = command;
+        common.data_len = sizeof(Body);
+        std::memcpy(&body, &b, sizeof(Body));
+    }
+};
+
+
+/* The wire image of a constant response, signature and checksum included.
+ * Declare it "static constexpr" to build it at compile time into read-only
+ * memory, and register it by Server::set_static_response() */
+template <std::size_t N>
+struct ConstResponse {
+    std::uint8_t wire[sizeof(uds_command_t) + N];
+
+    const uds_command_t *get() const noexcept
+    {
+        return reinterpret_cast<const uds_command_t *>(wire);
+    }
+};
+
+namespace detail {
+
+/* Integers on the wire are in host byte order */
+constexpr void put_uint(std::uint8_t *p, std::uint32_t v, int bytes) noexcept
+{
+    for (int i = 0; i < bytes; i++) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        p[bytes - 1 - i] = static_cast<std::uint8_t>(v >> (8 * i));
+#else
+        p[i] = static_cast<std::uint8_t>(v >> (8 * i));
+#endif
+    }
+}
+
+constexpr std::uint16_t get_u16(const std::uint8_t *p) noexcept
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return static_cast<std::uint16_t>((p[0] << 8) | p[1]);
+#else
+    return static_cast<std::uint16_t>(p[0] | (p[1] << 8));
+#endif
+}
+
+/* The same checksum as compute_checksum() in uds.c */
+constexpr std::uint16_t checksum(const std::uint8_t *p, std::size_t len)
+    noexcept
+{
+    unsigned long sum = 0;
+
+    for (std::size_t i = 0; i + 1 < len; i += 2) {
+        sum += get_u16(p + i);
+    }
+    if (len & 1) {
+        sum += p[len - 1];
+    }
+    while (sum >> 16) {
+        sum = (sum >> 16) + (sum & 0xFFFF);
+    }
+    return static_cast<std::uint16_t>(~sum);
+}
+
+} // namespace detail
+
+/* Build a constant response, e.g.
+ *     static constexpr auto ver = uds::make_const_response(STATUS_SUCCESS,
+ *         std::array<std::uint8_t, 2>{1, 0});
+ */
+template <std::size_t N>
+constexpr ConstResponse<N> make_const_response(std::uint32_t status,
+    const std::array<std::uint8_t, N> &payload)
+{
+    static_assert(sizeof(uds_command_t) == 14, "unexpected packet header");
+    ConstResponse<N> r{};
+
+    detail::put_uint(r.wire, UDS_SIGNATURE, 4);
+    detail::put_uint(r.wire + 4, status, 4);
+    detail::put_uint(r.wire + 8, static_cast<std::uint32_t>(N), 4);
+    for (std::size_t i = 0; i < N; i++) {
+        r.wire[sizeof(uds_command_t) + i] = payload[i];
+    }
+    detail::put_uint(r.wire + 12, detail::checksum(r.wire, sizeof(r.wire)),
+                     2);
+    return r;
+}
+
+/* A constant response of a string, with its NUL */
+template <std::size_t N>
+constexpr ConstResponse<N> make_const_response(std::uint32_t status,
+    const char (&str)[N])
+{
+    std::array<std::uint8_t, N> payload{};
+    for (std::size_t i = 0; i < N; i++) {
+        payload[i] = static_cast<std::uint8_t>(str[i]);
+    }
+    return make_const_response(status, payload);
+}
+
+/* A constant response without data */
+constexpr ConstResponse<0> make_const_response(std::uint32_t status)
+{
+    return make_const_response(status, std::array<std::uint8_t, 0>{});
+}
+
+
+/*--------------------------------------------------------------
+ * Client
+ *--------------------------------------------------------------*/
+
+class Client {
+public:
+    /* Connect with default configuration, wait timeout seconds for the
+     * server. Throw std::runtime_error if failed */
+    explicit Client(const char *path, int timeout = 0)
+        : c_(client_init(path, timeout))
+    {
+        if (c_ == nullptr) {
+            throw std::runtime_error(std::string("uds: can't connect to ") +
+                                     path);
+        }
+    }
+
+    Client(const char *path, const uds_client_config_t &cfg)
+        : c_(client_init_config(path, &cfg))
+    {
+        if (c_ == nullptr) {
+            throw std::runtime_error(std::string("uds: can't connect to ") +
+                                     path);
+        }
+    }
+
+    Client(Client &&o) noexcept
+        : c_(std::exchange(o.c_, nullptr)), scratch_(std::move(o.scratch_))
+    {
+    }
+    Client &operator=(Client &&o) noexcept
+    {
+        std::swap(c_, o.c_);
+        std::swap(scratch_, o.scratch_);
+        return *this;
+    }
+    Client(const Client &) = delete;
+    Client &operator=(const Client &) = delete;
+    ~Client()
+    {
+        if (c_ != nullptr) {
+            client_close(c_);
+        }
+    }
+
+    /* Send a request packet, its signature and checksum are filled in.
+     * The response is empty if failed */
+    Response call(uds_command_t &req)
+    {
+        return Response(client_send_request(c_, &req));
+    }
+
+    template <class Body>
+    Response call(Packet<Body> &req)
+    {
+        return call(req.common);
+    }
+
+    /* Send a command with payload, built in a buffer reused by calls */
+    Response call(std::uint32_t command, bytes payload = bytes())
+    {
+        scratch_.resize(sizeof(uds_command_t) + payload.size());
+        auto *req = reinterpret_cast<uds_command_t *>(scratch_.data());
+        std::memset(req, 0, sizeof(uds_command_t));
+        req->command = command;
+        req->data_len = static_cast<std::uint32_t>(payload.size());
+        if (!payload.empty()) {
+            std::memcpy(req + 1, payload.data(), payload.size());
+        }
+        return call(*req);
+    }
+
+    uds_client_t *get() const noexcept { return c_; }
+
+private:
+    uds_client_t *c_;
+    std::pmr::vector<std::uint8_t> scratch_{library_resource()};
+};
+
+
+/*--------------------------------------------------------------
+ * Server
+ *--------------------------------------------------------------*/
+
+class Server {
+public:
+    /* Create the server and its first listener. The handler is any
+     * callable "Response (const Request &)", called by all connection
+     * threads at the same time. Throw std::runtime_error if failed */
+    template <class Handler>
+    Server(const char *path, Handler &&handler,
+           const uds_server_config_t *cfg = nullptr)
+    {
+        using H = std::decay_t<Handler>;
+        static_assert(std::is_invocable_r_v<Response, H &, const Request &>,
+                      "Handler shall be callable as Response(const Request&)");
+        uds_server_config_t defaults;
+
+        if (cfg == nullptr) {
+            server_config_init(&defaults);
+            cfg = &defaults;
+        }
+
+        /* The handler is kept on heap, so the context given to the C
+         * library is not moved with the server */
+        std::pmr::polymorphic_allocator<H> alloc(library_resource());
+        H *h = alloc.allocate(1);
+        try {
+            ::new (static_cast<void *>(h)) H(std::forward<Handler>(handler));
+        } catch (...) {
+            alloc.deallocate(h, 1);
+            throw;
+        }
+        handler_ = h;
+        destroy_ = [](void *p) {
+            std::pmr::polymorphic_allocator<H> a(library_resource());
+            static_cast<H *>(p)->~H();
+            a.deallocate(static_cast<H *>(p), 1);
+        };
+
+        s_ = server_init_config(path, nullptr, cfg);
+        if (s_ == nullptr) {
+            destroy_(handler_);
+            throw std::runtime_error(std::string("uds: can't listen on ") +
+                                     path);
+        }
+        server_set_handler_ctx(s_, &invoke<H>, h);
+    }
+
+    Server(Server &&o) noexcept
+        : s_(std::exchange(o.s_, nullptr)),
+          handler_(std::exchange(o.handler_, nullptr)),
+          destroy_(std::exchange(o.destroy_, nullptr))
+    {
+    }
+    Server &operator=(Server &&o) noexcept
+    {
+        std::swap(s_, o.s_);
+        std::swap(handler_, o.handler_);
+        std::swap(destroy_, o.destroy_);
+        return *this;
+    }
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+    ~Server()
+    {
+        /* server_close() joins the connection threads first */
+        if (s_ != nullptr) {
+            server_close(s_);
+        }
+        if (destroy_ != nullptr) {
+            destroy_(handler_);
+        }
+    }
+
+    /* Answer a request type with a response encoded once here */
+    bool set_const_response(std::uint32_t command, std::uint32_t status,
+                            bytes payload = bytes())
+    {
+        return server_set_const_response(s_, command, status, payload.data(),
+            static_cast<std::uint32_t>(payload.size())) == 0;
+    }
+
+    /* Answer a request type with a response built at compile time, it is
+     * sent from where it is, so it shall outlive the server */
+    template <std::size_t N>
+    bool set_static_response(std::uint32_t command,
+                             const ConstResponse<N> &resp)
+    {
+        return server_set_static_response(s_, command, resp.get()) == 0;
+    }
+
+    /* Handle a request type by a handler of its own, e.g. of a plugin. It
+     * can be changed while the server is running, synchronize() waits for
+     * the requests still running the old one */
+    bool register_command(std::uint32_t command,
+                          request_handler_ctx_t handler, void *ctx)
+    {
+        return server_register_command(s_, command, handler, ctx) == 0;
+    }
+
+    bool unregister_command(std::uint32_t command)
+    {
+        return server_unregister_command(s_, command) == 0;
+    }
+
+    void synchronize()
+    {
+        server_synchronize(s_);
+    }
+
+    bool add_listener(const char *path,
+                      const uds_listener_attr_t *attr = nullptr)
+    {
+        return server_add_listener(s_, path, attr) == 0;
+    }
+
+    bool run(volatile sig_atomic_t &run_flag)
+    {
+        return server_run(s_, &run_flag) == 0;
+    }
+
+    bool prefork(int nworkers, volatile sig_atomic_t &run_flag)
+    {
+        return server_prefork(s_, nworkers, &run_flag) == 0;
+    }
+
+    bool reconfigure(const char *text)
+    {
+        return server_reconfigure(s_, text) == 0;
+    }
+
+    uds_stats_t stats() const
+    {
+        uds_stats_t st;
+        server_get_stats(s_, &st);
+        return st;
+    }
+
+    uds_server_t *get() const noexcept { return s_; }
+
+private:
+    /* Exceptions shall not pass through the C library */
+    template <class H>
+    static uds_command_t *invoke(void *ctx, uds_command_t *req) noexcept
+    {
+        try {
+            return (*static_cast<H *>(ctx))(Request(req)).release();
+        } catch (...) {
+            return nullptr;
+        }
+    }
+
+    uds_server_t *s_ = nullptr;
+    void *handler_ = nullptr;
+    void (*destroy_)(void *) = nullptr;
+};
+
+} // namespace uds
+
+
+#endif /* _UDS_HPP_ */
@@ -0,0 +1,617 @@
+/******************************************************************************
+*
+* FILENAME:
+*     uds_config.c
+*
+* DESCRIPTION:
+*     Runtime configuration of server and client. Load the configuration
+*     from environment variables or a config file.
+*
+* REVISION(MM/DD/YYYY):
+*     10/18/2026
+*     - Initial version
+*
+******************************************************************************/
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "uds.h"
+
+
+/* Type of the value of configuration item */
+enum config_type {
+    CONFIG_INT,         /* int */
+    CONFIG_SIZE,        /* size_t */
+    CONFIG_SOCK_TYPE,   /* int, "stream" or "seqpacket" */
+    CONFIG_ENGINE,      /* int, "thread" or "prefork" */
+    CONFIG_RATE_KEY,    /* int, "uid" or "pid" */
+    CONFIG_CPU_LIST,    /* char[UDS_CPU_LIST_LEN] */
+};
+
+/* The item can be changed on a running server */
+#define CONFIG_LIVE     1
+
+/* Description of a configuration item */
+typedef struct config_item {
+    const char *key;    /* Key in config file, "UDS_" + upper case for env */
+    int type;           /* Type of the value */
+    int flags;          /* CONFIG_LIVE or 0 */
+    size_t offset;      /* Offset of the field in configuration structure */
+} config_item_t;
+
+#define SERVER_ITEM(key, type, flags) \
+    { #key, type, flags, offsetof(uds_server_config_t, key) }
+#define CLIENT_ITEM(key, type) \
+    { #key, type, 0, offsetof(uds_client_config_t, key) }
+
+static const config_item_t server_items[] = {
+    SERVER_ITEM(sock_type,      CONFIG_SOCK_TYPE,   0),
+    SERVER_ITEM(buf_size,       CONFIG_SIZE,        0),
+    SERVER_ITEM(backlog,        CONFIG_INT,         0),
+    SERVER_ITEM(max_client,     CONFIG_INT,         CONFIG_LIVE),
+    SERVER_ITEM(engine,         CONFIG_ENGINE,      0),
+    SERVER_ITEM(workers,        CONFIG_INT,         CONFIG_LIVE),
+    SERVER_ITEM(stack_size,     CONFIG_SIZE,        0),
+    SERVER_ITEM(recv_timeout,   CONFIG_INT,         CONFIG_LIVE),
+    SERVER_ITEM(sndbuf,         CONFIG_INT,         CONFIG_LIVE),
+    SERVER_ITEM(rcvbuf,         CONFIG_INT,         CONFIG_LIVE),
+    SERVER_ITEM(log_level,      CONFIG_INT,         CONFIG_LIVE),
+    SERVER_ITEM(slow_request_ms, CONFIG_INT,        CONFIG_LIVE),
+    SERVER_ITEM(max_inflight,   CONFIG_INT,         CONFIG_LIVE),
+    SERVER_ITEM(queue_limit,    CONFIG_INT,         CONFIG_LIVE),
+    SERVER_ITEM(queue_target_ms, CONFIG_INT,        CONFIG_LIVE),
+    SERVER_ITEM(queue_interval_ms, CONFIG_INT,      CONFIG_LIVE),
+    SERVER_ITEM(rate_limit,     CONFIG_INT,         CONFIG_LIVE),
+    SERVER_ITEM(rate_burst,     CONFIG_INT,         CONFIG_LIVE),
+    SERVER_ITEM(rate_key,       CONFIG_RATE_KEY,    0),
+    SERVER_ITEM(cpu_list,       CONFIG_CPU_LIST,    0),
+    SERVER_ITEM(numa_follow_peer, CONFIG_INT,       0),
+    SERVER_ITEM(busy_poll_us,   CONFIG_INT,         CONFIG_LIVE),
+    SERVER_ITEM(sockbuf_min,    CONFIG_SIZE,        CONFIG_LIVE),
+    SERVER_ITEM(sockbuf_max,    CONFIG_SIZE,        CONFIG_LIVE),
+    SERVER_ITEM(multi_threads,  CONFIG_INT,         CONFIG_LIVE),
+    SERVER_ITEM(snapshot_size,  CONFIG_SIZE,        0),
+    SERVER_ITEM(snapshot_unsealed, CONFIG_INT,      0),
+    { NULL, 0, 0, 0 }
+};
+
+static const config_item_t client_items[] = {
+    CLIENT_ITEM(sock_type,      CONFIG_SOCK_TYPE),
+    CLIENT_ITEM(buf_size,       CONFIG_SIZE),
+    CLIENT_ITEM(connect_timeout, CONFIG_INT),
+    CLIENT_ITEM(recv_timeout,   CONFIG_INT),
+    CLIENT_ITEM(sndbuf,         CONFIG_INT),
+    CLIENT_ITEM(rcvbuf,         CONFIG_INT),
+    CLIENT_ITEM(busy_poll_us,   CONFIG_INT),
+    CLIENT_ITEM(breaker_threshold, CONFIG_INT),
+    CLIENT_ITEM(breaker_cooldown_ms, CONFIG_INT),
+    { NULL, 0, 0, 0 }
+};
+
+
+/******************************************************************************
+ * NAME:
+ *      config_set
+ *
+ * DESCRIPTION:
+ *      Set the value of a configuration item.
+ *
+ * PARAMETERS:
+ *      items - The description of configuration items
+ *      cfg   - The configuration structure
+ *      key   - The key of item
+ *      value - The value of item in string
+ *      flags - Required flags of the item, CONFIG_LIVE or 0
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int config_set(const config_item_t *items, void *cfg, const char *key,
+    const char *value, int flags)
+{
+    const config_item_t *item;
+    char *end;
+    long val;
+
+    for (item = items; item->key != NULL; item++) {
+        if (strcmp(item->key, key) == 0) {
+            break;
+        }
+    }
+    if (item->key == NULL) {
+        printf("Error: unknown config item \"%s\"\n", key);
+        return -1;
+    }
+    if ((item->flags & flags) != flags) {
+        printf("Error: config item \"%s\" can't be changed at runtime\n", key);
+        return -1;
+    }
+
+    switch (item->type) {
+    case CONFIG_SOCK_TYPE:
+        if (strcmp(value, "stream") == 0) {
+            val = SOCK_STREAM;
+        } else if (strcmp(value, "seqpacket") == 0) {
+            val = SOCK_SEQPACKET;
+        } else {
+            goto invalid;
+        }
+        *(int *)((char *)cfg + item->offset) = (int)val;
+        break;
+
+    case CONFIG_ENGINE:
+        if (strcmp(value, "thread") == 0) {
+            val = UDS_ENGINE_THREAD;
+        } else if (strcmp(value, "prefork") == 0) {
+            val = UDS_ENGINE_PREFORK;
+        } else {
+            goto invalid;
+        }
+        *(int *)((char *)cfg + item->offset) = (int)val;
+        break;
+
+    case CONFIG_RATE_KEY:
+        if (strcmp(value, "uid") == 0) {
+            val = UDS_RATE_KEY_UID;
+        } else if (strcmp(value, "pid") == 0) {
+            val = UDS_RATE_KEY_PID;
+        } else {
+            goto invalid;
+        }
+        *(int *)((char *)cfg + item->offset) = (int)val;
+        break;
+
+    case CONFIG_CPU_LIST:
+        if ((strlen(value) >= UDS_CPU_LIST_LEN) ||
+                (strspn(value, "0123456789,-") != strlen(value))) {
+            goto invalid;
+        }
+        strcpy((char *)cfg + item->offset, value);
+        break;
+
+    default:
+        errno = 0;
+        val = strtol(value, &end, 0);
+        if ((end == value) || (*end != '\0') || (val < 0) ||
+                (errno == ERANGE) ||
+                ((item->type == CONFIG_INT) && (val > INT_MAX))) {
+            goto invalid;
+        }
+        if (item->type == CONFIG_SIZE) {
+            *(size_t *)((char *)cfg + item->offset) = (size_t)val;
+        } else {
+            *(int *)((char *)cfg + item->offset) = (int)val;
+        }
+        break;
+    }
+
+    return 0;
+
+invalid:
+    printf("Error: invalid value of config item \"%s\": %s\n", key, value);
+    return -1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      config_load_env
+ *
+ * DESCRIPTION:
+ *      Load configuration items from environment variables. The variable of
+ *      item "buf_size" is "UDS_BUF_SIZE", and so on.
+ *
+ * PARAMETERS:
+ *      items - The description of configuration items
+ *      cfg   - The configuration structure
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int config_load_env(const config_item_t *items, void *cfg)
+{
+    const config_item_t *item;
+    char name[64];
+    const char *value;
+    int i, rc = 0;
+
+    for (item = items; item->key != NULL; item++) {
+        snprintf(name, sizeof(name), "UDS_%s", item->key);
+        for (i = 4; name[i] != '\0'; i++) {
+            name[i] = toupper((unsigned char)name[i]);
+        }
+
+        value = getenv(name);
+        if (value == NULL) {
+            continue;
+        }
+        if (config_set(items, cfg, item->key, value, 0) != 0) {
+            rc = -1;
+        }
+    }
+
+    return rc;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      config_parse_line
+ *
+ * DESCRIPTION:
+ *      Parse a line of "key = value" and set the configuration item. The
+ *      line is modified. Empty line and comment starts with '#' are ignored.
+ *
+ * PARAMETERS:
+ *      items - The description of configuration items
+ *      cfg   - The configuration structure
+ *      line  - The line to parse
+ *      flags - Required flags of the item, CONFIG_LIVE or 0
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int config_parse_line(const config_item_t *items, void *cfg,
+    char *line, int flags)
+{
+    char *key, *value, *p;
+
+    /* Strip comment and trailing spaces */
+    p = strchr(line, '#');
+    if (p != NULL) {
+        *p = '\0';
+    }
+    p = line + strlen(line);
+    while ((p > line) && isspace((unsigned char)p[-1])) {
+        *--p = '\0';
+    }
+
+    key = line;
+    while (isspace((unsigned char)*key)) {
+        key++;
+    }
+    if (*key == '\0') {
+        return 0;
+    }
+
+    value = strchr(key, '=');
+    if (value == NULL) {
+        printf("Error: missing '=' in config \"%s\"\n", key);
+        return -1;
+    }
+    p = value;
+    *value++ = '\0';
+    while ((p > key) && isspace((unsigned char)p[-1])) {
+        *--p = '\0';
+    }
+    while (isspace((unsigned char)*value)) {
+        value++;
+    }
+
+    return config_set(items, cfg, key, value, flags);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      config_load_file
+ *
+ * DESCRIPTION:
+ *      Load configuration items from a config file. Each line of the file is
+ *      "key = value", the line starts with '#' is comment.
+ *
+ * PARAMETERS:
+ *      items - The description of configuration items
+ *      cfg   - The configuration structure
+ *      path  - The path of config file
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int config_load_file(const config_item_t *items, void *cfg,
+    const char *path)
+{
+    FILE *fp;
+    char line[256];
+    int lineno = 0, rc = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror("fopen error");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if (config_parse_line(items, cfg, line, 0) != 0) {
+            printf("Error: %s:%d: invalid config\n", path, lineno);
+            rc = -1;
+        }
+    }
+
+    fclose(fp);
+    return rc;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_config_init
+ *
+ * DESCRIPTION:
+ *      Fill the server configuration with default values.
+ *
+ * PARAMETERS:
+ *      cfg - The server configuration
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void server_config_init(uds_server_config_t *cfg)
+{
+    if (cfg == NULL) {
+        return;
+    }
+
+    memset(cfg, 0, sizeof(uds_server_config_t));
+    cfg->sock_type = UDS_SOCK_TYPE;
+    cfg->buf_size = UDS_BUF_SIZE;
+    cfg->backlog = UDS_MAX_BACKLOG;
+    cfg->max_client = UDS_MAX_CLIENT;
+    cfg->engine = UDS_ENGINE_THREAD;
+    cfg->log_level = UDS_LOG_INFO;
+    cfg->queue_target_ms = UDS_QUEUE_TARGET_MS;
+    cfg->queue_interval_ms = UDS_QUEUE_INTERVAL_MS;
+    cfg->rate_burst = UDS_RATE_BURST;
+    cfg->rate_key = UDS_RATE_KEY_UID;
+    cfg->sockbuf_min = UDS_SOCKBUF_MIN;
+    cfg->multi_threads = UDS_MULTI_THREADS;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_config_load_env
+ *
+ * DESCRIPTION:
+ *      Override the server configuration by environment variables, e.g.
+ *      UDS_BUF_SIZE, UDS_MAX_CLIENT, UDS_ENGINE.
+ *
+ * PARAMETERS:
+ *      cfg - The server configuration
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_config_load_env(uds_server_config_t *cfg)
+{
+    if (cfg == NULL) {
+        return -1;
+    }
+
+    return config_load_env(server_items, cfg);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_config_load_file
+ *
+ * DESCRIPTION:
+ *      Override the server configuration by a config file.
+ *
+ * PARAMETERS:
+ *      cfg  - The server configuration
+ *      path - The path of config file
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_config_load_file(uds_server_config_t *cfg, const char *path)
+{
+    if ((cfg == NULL) || (path == NULL)) {
+        return -1;
+    }
+
+    return config_load_file(server_items, cfg, path);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_config_update
+ *
+ * DESCRIPTION:
+ *      Change the server configuration by "key = value" lines in a string.
+ *      Nothing is changed if any line is invalid.
+ *
+ * PARAMETERS:
+ *      cfg       - The server configuration
+ *      text      - The lines of configuration
+ *      live_only - 1: only the items can be changed on a running server
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_config_update(uds_server_config_t *cfg, const char *text,
+    int live_only)
+{
+    uds_server_config_t tmp;
+    char *buf, *line, *next;
+    int rc = 0;
+
+    if ((cfg == NULL) || (text == NULL)) {
+        return -1;
+    }
+
+    buf = (char *)uds_malloc(strlen(text) + 1);
+    if (buf == NULL) {
+        perror("malloc error");
+        return -1;
+    }
+    strcpy(buf, text);
+
+    tmp = *cfg;
+    for (line = buf; line != NULL; line = next) {
+        next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        if (config_parse_line(server_items, &tmp, line,
+                live_only ? CONFIG_LIVE : 0) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    uds_free(buf);
+
+    if (rc == 0) {
+        *cfg = tmp;
+    }
+    return rc;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_config_dump
+ *
+ * DESCRIPTION:
+ *      Write the server configuration to a string, "key = value" per line.
+ *
+ * PARAMETERS:
+ *      cfg - The server configuration
+ *      buf - The buffer to keep the string
+ *      len - The length of buffer
+ *
+ * RETURN:
+ *      The length of string, truncated if the buffer is too small.
+ ******************************************************************************/
+size_t server_config_dump(const uds_server_config_t *cfg, char *buf,
+    size_t len)
+{
+    const config_item_t *item;
+    const char *p;
+    size_t pos = 0;
+    int n;
+
+    if ((cfg == NULL) || (buf == NULL) || (len == 0)) {
+        return 0;
+    }
+
+    buf[0] = '\0';
+    for (item = server_items; (item->key != NULL) && (pos < len); item++) {
+        p = (const char *)cfg + item->offset;
+        switch (item->type) {
+        case CONFIG_SOCK_TYPE:
+            n = snprintf(buf + pos, len - pos, "%s = %s\n", item->key,
+                (*(const int *)p == SOCK_SEQPACKET) ? "seqpacket" : "stream");
+            break;
+
+        case CONFIG_ENGINE:
+            n = snprintf(buf + pos, len - pos, "%s = %s\n", item->key,
+                (*(const int *)p == UDS_ENGINE_PREFORK) ? "prefork" : "thread");
+            break;
+
+        case CONFIG_RATE_KEY:
+            n = snprintf(buf + pos, len - pos, "%s = %s\n", item->key,
+                (*(const int *)p == UDS_RATE_KEY_PID) ? "pid" : "uid");
+            break;
+
+        case CONFIG_CPU_LIST:
+            n = snprintf(buf + pos, len - pos, "%s = %s\n", item->key, p);
+            break;
+
+        case CONFIG_SIZE:
+            n = snprintf(buf + pos, len - pos, "%s = %zu\n", item->key,
+                *(const size_t *)p);
+            break;
+
+        default:
+            n = snprintf(buf + pos, len - pos, "%s = %d\n", item->key,
+                *(const int *)p);
+            break;
+        }
+        pos += n;
+    }
+
+    return (pos < len) ? pos : len - 1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_config_init
+ *
+ * DESCRIPTION:
+ *      Fill the client configuration with default values.
+ *
+ * PARAMETERS:
+ *      cfg - The client configuration
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void client_config_init(uds_client_config_t *cfg)
+{
+    if (cfg == NULL) {
+        return;
+    }
+
+    memset(cfg, 0, sizeof(uds_client_config_t));
+    cfg->sock_type = UDS_SOCK_TYPE;
+    cfg->buf_size = UDS_BUF_SIZE;
+    cfg->breaker_threshold = UDS_BREAKER_THRESHOLD;
+    cfg->breaker_cooldown_ms = UDS_BREAKER_COOLDOWN_MS;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_config_load_env
+ *
+ * DESCRIPTION:
+ *      Override the client configuration by environment variables, e.g.
+ *      UDS_BUF_SIZE, UDS_CONNECT_TIMEOUT.
+ *
+ * PARAMETERS:
+ *      cfg - The client configuration
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int client_config_load_env(uds_client_config_t *cfg)
+{
+    if (cfg == NULL) {
+        return -1;
+    }
+
+    return config_load_env(client_items, cfg);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_config_load_file
+ *
+ * DESCRIPTION:
+ *      Override the client configuration by a config file.
+ *
+ * PARAMETERS:
+ *      cfg  - The client configuration
+ *      path - The path of config file
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int client_config_load_file(uds_client_config_t *cfg, const char *path)
+{
+    if ((cfg == NULL) || (path == NULL)) {
+        return -1;
+    }
+
+    return config_load_file(client_items, cfg, path);
+}
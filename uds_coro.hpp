@@ -0,0 +1,782 @@
+/******************************************************************************
+*
+* FILENAME:
+*     uds_coro.hpp
+*
+* DESCRIPTION:
+*     C++20 coroutine client. Calls are pipelined on a non-blocking
+*     connection and awaited without blocking a thread:
+*
+*         uds::Task<> work(uds::AsyncClient &c)
+*         {
+*             uds::PooledResponse r = co_await c.call(CMD_GET_VERSION);
+*             ...
+*         }
+*
+*         uds::Reactor reactor;
+*         uds::AsyncClient c(reactor, UDS_SOCK_PATH);
+*         uds::spawn(work(c));
+*         reactor.run(run_flag);
+*
+*     The server answers the requests of a connection in order, so the
+*     responses are matched to the pending calls first in, first out, no
+*     request id is added to the packet. A call allocates nothing once the
+*     connection is warmed up: the pending call lives in the awaiting
+*     coroutine frame, the frames of coroutines taking the client as first
+*     parameter come from a pool of the client, and so do the responses.
+*
+* REVISION(MM/DD/YYYY):
+*     10/18/2026
+*     - Initial version
+*
+******************************************************************************/
+#ifndef _UDS_CORO_HPP_
+#define _UDS_CORO_HPP_
+#if !defined(__cpp_impl_coroutine)
+#error "uds_coro.hpp requires C++20 coroutines"
+#endif
+#include <cerrno>
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <optional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "uds.hpp"
+
+
+namespace uds {
+
+class AsyncClient;
+
+/*--------------------------------------------------------------
+ * Pools of a connection
+ *--------------------------------------------------------------*/
+
+/* Coroutine frames of a few sizes, kept in free lists for reuse */
+class FramePool {
+public:
+    FramePool() = default;
+    FramePool(const FramePool &) = delete;
+    FramePool &operator=(const FramePool &) = delete;
+    ~FramePool()
+    {
+        for (Bucket &b : buckets_) {
+            while (b.head != nullptr) {
+                Header *h = b.head;
+                b.head = h->next;
+                uds_free(h);
+            }
+        }
+    }
+
+    /* Allocate a frame, pool is nullptr for no reuse */
+    static void *allocate(FramePool *pool, std::size_t n)
+    {
+        std::size_t size = (n + kGrain - 1) / kGrain * kGrain;
+        Header *h = nullptr;
+
+        Bucket *b = (pool != nullptr) ? pool->bucket(size) : nullptr;
+        if ((b != nullptr) && (b->head != nullptr)) {
+            h = b->head;
+            b->head = h->next;
+        } else {
+            h = static_cast<Header *>(uds_malloc(sizeof(Header) + size));
+            if (h == nullptr) {
+                throw std::bad_alloc();
+            }
+        }
+        h->pool = (b != nullptr) ? pool : nullptr;
+        h->size = size;
+        return h + 1;
+    }
+
+    static void deallocate(void *p) noexcept
+    {
+        Header *h = static_cast<Header *>(p) - 1;
+        Bucket *b = (h->pool != nullptr) ? h->pool->bucket(h->size) : nullptr;
+
+        if (b == nullptr) {
+            uds_free(h);
+            return;
+        }
+        h->next = b->head;
+        b->head = h;
+    }
+
+private:
+    static constexpr std::size_t kGrain = 64;
+    static constexpr int kBuckets = 8;
+
+    static_assert(__STDCPP_DEFAULT_NEW_ALIGNMENT__ <= UDS_ALLOC_ALIGN,
+                  "uds_malloc() can't align coroutine frames");
+
+    /* Keeps the default alignment of new for the frame after it */
+    struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) Header {
+        union {
+            FramePool *pool;    /* The owner, nullptr: global heap */
+            Header *next;       /* Next free frame in the bucket */
+        };
+        std::size_t size;
+    };
+
+    struct Bucket {
+        std::size_t size = 0;   /* Frame size of the bucket, 0: unused */
+        Header *head = nullptr;
+    };
+
+    /* The bucket of a frame size, nullptr if all buckets are used */
+    Bucket *bucket(std::size_t size) noexcept
+    {
+        for (Bucket &b : buckets_) {
+            if (b.size == size) {
+                return &b;
+            }
+            if (b.size == 0) {
+                b.size = size;
+                return &b;
+            }
+        }
+        return nullptr;
+    }
+
+    Bucket buckets_[kBuckets];
+};
+
+
+/* Response buffers of buf_size bytes, kept in a free list for reuse */
+class BufferPool {
+public:
+    explicit BufferPool(std::size_t size) : size_(size) {}
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+    ~BufferPool()
+    {
+        for (std::uint8_t *p : all_) {
+            uds_free(p);
+        }
+    }
+
+    std::uint8_t *get()
+    {
+        if (free_.empty()) {
+            all_.reserve(all_.size() + 1);
+            free_.reserve(all_.size() + 1);
+            auto *p = static_cast<std::uint8_t *>(uds_malloc(size_));
+            if (p == nullptr) {
+                throw std::bad_alloc();
+            }
+            all_.push_back(p);
+            return p;
+        }
+        std::uint8_t *p = free_.back();
+        free_.pop_back();
+        return p;
+    }
+
+    void put(std::uint8_t *p)
+    {
+        free_.push_back(p);
+    }
+
+    std::size_t size() const noexcept { return size_; }
+
+private:
+    std::size_t size_;
+    std::pmr::vector<std::uint8_t *> all_{library_resource()};
+    std::pmr::vector<std::uint8_t *> free_{library_resource()};
+};
+
+
+/* A response in a buffer of the pool of connection, given back to the pool
+ * when it is destroyed, so it shall not outlive the AsyncClient */
+class PooledResponse : public detail::packet_view<PooledResponse> {
+public:
+    PooledResponse() noexcept : pool_(nullptr), buf_(nullptr) {}
+    PooledResponse(BufferPool *pool, std::uint8_t *buf) noexcept
+        : pool_(pool), buf_(buf) {}
+    PooledResponse(PooledResponse &&o) noexcept
+        : pool_(o.pool_), buf_(std::exchange(o.buf_, nullptr)) {}
+    PooledResponse &operator=(PooledResponse &&o) noexcept
+    {
+        std::swap(pool_, o.pool_);
+        std::swap(buf_, o.buf_);
+        return *this;
+    }
+    PooledResponse(const PooledResponse &) = delete;
+    PooledResponse &operator=(const PooledResponse &) = delete;
+    ~PooledResponse()
+    {
+        if (buf_ != nullptr) {
+            pool_->put(buf_);
+        }
+    }
+
+    explicit operator bool() const noexcept { return buf_ != nullptr; }
+    std::uint32_t status() const noexcept { return get()->status; }
+    const uds_command_t *get() const noexcept
+    {
+        return reinterpret_cast<const uds_command_t *>(buf_);
+    }
+
+private:
+    BufferPool *pool_;
+    std::uint8_t *buf_;
+};
+
+
+/*--------------------------------------------------------------
+ * Executor and tasks
+ *--------------------------------------------------------------*/
+
+/* Where the completed calls are resumed. By default they are resumed at
+ * once in the thread running the reactor; any object with a member
+ * "void post(std::coroutine_handle<>)" can be used, e.g. a queue drained
+ * later in the reactor thread. The client and its pools are not locked,
+ * so the coroutines shall be resumed in the reactor thread: not in a
+ * thread pool */
+class Executor {
+public:
+    constexpr Executor() noexcept : ctx_(nullptr), post_(nullptr) {}
+
+    template <class E, class = std::enable_if_t<
+        !std::is_same_v<std::remove_cv_t<E>, Executor>>>
+    Executor(E &e) noexcept
+        : ctx_(&e), post_([](void *ctx, std::coroutine_handle<> h) {
+              static_cast<E *>(ctx)->post(h);
+          })
+    {
+    }
+
+    void post(std::coroutine_handle<> h) const
+    {
+        if (post_ != nullptr) {
+            post_(ctx_, h);
+        } else {
+            h.resume();
+        }
+    }
+
+private:
+    void *ctx_;
+    void (*post_)(void *, std::coroutine_handle<>);
+};
+
+
+template <class T = void>
+class Task;
+
+namespace detail {
+
+class promise_base {
+public:
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+
+        template <class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h)
+            noexcept
+        {
+            promise_base &p = h.promise();
+            if (p.continuation_) {
+                return p.continuation_;
+            }
+            if (p.detached_) {
+                h.destroy();
+            }
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { error_ = std::current_exception(); }
+
+    /* Frames of coroutines whose first parameter is the client (or member
+     * functions of it) come from its pool */
+#if defined(__GNUC__) && !defined(__clang__) && (__GNUC__ >= 11)
+    /* GCC takes a template placement new as mismatched with the usual
+     * delete of the frame, a false positive. It is reported at the end of
+     * each coroutine using the pool, so it can't be popped here */
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+    template <class... Args>
+    static void *operator new(std::size_t n, AsyncClient &c, Args &&...);
+    template <class This, class... Args, class = std::enable_if_t<
+        !std::is_same_v<std::remove_cv_t<This>, AsyncClient>>>
+    static void *operator new(std::size_t n, This &, AsyncClient &c,
+                              Args &&...);
+    static void *operator new(std::size_t n)
+    {
+        return FramePool::allocate(nullptr, n);
+    }
+    static void operator delete(void *p, std::size_t) noexcept
+    {
+        FramePool::deallocate(p);
+    }
+
+    std::coroutine_handle<> continuation_;
+    std::exception_ptr error_;
+    bool detached_ = false;
+};
+
+} // namespace detail
+
+
+/* A lazy coroutine, started by co_await or spawn() */
+template <class T>
+class Task {
+public:
+    struct promise_type : detail::promise_base {
+        Task get_return_object() noexcept
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(
+                *this));
+        }
+        template <class V>
+        void return_value(V &&v)
+        {
+            value_.emplace(std::forward<V>(v));
+        }
+
+        std::optional<T> value_;
+    };
+
+    Task(Task &&o) noexcept : h_(std::exchange(o.h_, nullptr)) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+        if (h_) {
+            h_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !h_ || h_.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont)
+        noexcept
+    {
+        h_.promise().continuation_ = cont;
+        return h_;
+    }
+    T await_resume()
+    {
+        if (h_.promise().error_) {
+            std::rethrow_exception(h_.promise().error_);
+        }
+        return std::move(*h_.promise().value_);
+    }
+
+    std::coroutine_handle<promise_type> release() noexcept
+    {
+        return std::exchange(h_, nullptr);
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+template <>
+class Task<void> {
+public:
+    struct promise_type : detail::promise_base {
+        Task get_return_object() noexcept
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(
+                *this));
+        }
+        void return_void() noexcept {}
+    };
+
+    Task(Task &&o) noexcept : h_(std::exchange(o.h_, nullptr)) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+        if (h_) {
+            h_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !h_ || h_.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont)
+        noexcept
+    {
+        h_.promise().continuation_ = cont;
+        return h_;
+    }
+    void await_resume()
+    {
+        if (h_.promise().error_) {
+            std::rethrow_exception(h_.promise().error_);
+        }
+    }
+
+    std::coroutine_handle<promise_type> release() noexcept
+    {
+        return std::exchange(h_, nullptr);
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+/* Start a task without waiting for it, its frame is freed when it is done.
+ * An exception escaping from it is dropped */
+template <class T>
+void spawn(Task<T> &&task)
+{
+    auto h = task.release();
+    h.promise().detached_ = true;
+    h.resume();
+}
+
+
+/*--------------------------------------------------------------
+ * Reactor and client
+ *--------------------------------------------------------------*/
+
+/* Wait for the I/O of async clients with epoll */
+class Reactor {
+public:
+    Reactor() : epfd_(epoll_create1(EPOLL_CLOEXEC))
+    {
+        if (epfd_ < 0) {
+            throw std::runtime_error("uds: epoll_create1 error");
+        }
+    }
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+    ~Reactor() { close(epfd_); }
+
+    /* Handle the ready connections, resume the completed calls. Return the
+     * count of ready connections, 0 if timeout */
+    int run_once(int timeout_ms);
+
+    /* Max wait of run() in a round(ms), then it checks the run flag */
+    static constexpr int kPollMs = 100;
+
+    /* Run until run_flag is cleared */
+    void run(volatile sig_atomic_t &run_flag)
+    {
+        while (run_flag) {
+            run_once(kPollMs);
+        }
+    }
+
+    int fd() const noexcept { return epfd_; }
+
+private:
+    int epfd_;
+};
+
+
+class AsyncClient {
+public:
+    /* A pending call, it lives in the frame of the awaiting coroutine. The
+     * request is queued when it is awaited, so the calls are sent in the
+     * order they are awaited */
+    class CallAwaiter {
+    public:
+        CallAwaiter(AsyncClient &c, std::uint32_t command,
+                    bytes payload) noexcept
+            : c_(c), command_(command), payload_(payload) {}
+
+        /* Don't wait if the request can't be sent */
+        bool await_ready() noexcept
+        {
+            return !c_.encode(command_, payload_);
+        }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            h_ = h;
+            c_.enqueue(this);
+        }
+
+        PooledResponse await_resume() noexcept { return std::move(resp_); }
+
+    private:
+        friend class AsyncClient;
+
+        AsyncClient &c_;
+        std::uint32_t command_;
+        bytes payload_;             /* Valid until the call is awaited */
+        std::coroutine_handle<> h_;
+        CallAwaiter *next_ = nullptr;
+        PooledResponse resp_;
+    };
+
+    /* Connect to the server, throw std::runtime_error if failed */
+    AsyncClient(Reactor &reactor, const char *path,
+                const uds_client_config_t *cfg = nullptr,
+                Executor ex = Executor())
+        : reactor_(reactor), ex_(ex), c_(connect(path, cfg)),
+          buffers_(c_->config.buf_size),
+          in_(2 * c_->config.buf_size, library_resource())
+    {
+        struct epoll_event ev = {};
+        int fd = c_->sockfd;
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = this;
+        if ((fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) ||
+                (epoll_ctl(reactor_.fd(), EPOLL_CTL_ADD, fd, &ev) != 0)) {
+            client_close(c_);
+            throw std::runtime_error("uds: can't watch the connection");
+        }
+    }
+    AsyncClient(const AsyncClient &) = delete;
+    AsyncClient &operator=(const AsyncClient &) = delete;
+    ~AsyncClient()
+    {
+        epoll_ctl(reactor_.fd(), EPOLL_CTL_DEL, c_->sockfd, nullptr);
+        client_close(c_);
+    }
+
+    /* Send a request; awaiting it gives the response, an empty one if the
+     * connection failed */
+    CallAwaiter call(std::uint32_t command, bytes payload = bytes())
+    {
+        return CallAwaiter(*this, command, payload);
+    }
+
+    /* Typed call, Cmd::command is the request type */
+    template <class Cmd>
+    CallAwaiter call()
+    {
+        return call(Cmd::command);
+    }
+
+    template <class Cmd, class Body>
+    CallAwaiter call(const Body &body)
+    {
+        static_assert(std::is_trivially_copyable_v<Body>,
+                      "Body shall be trivially copyable");
+        return call(Cmd::command, bytes(reinterpret_cast<const std::uint8_t *>(
+            &body), sizeof(Body)));
+    }
+
+    FramePool &frames() noexcept { return frames_; }
+    std::size_t pending() const noexcept { return npending_; }
+
+private:
+    friend class Reactor;
+
+    static uds_client_t *connect(const char *path,
+                                 const uds_client_config_t *cfg)
+    {
+        uds_client_config_t defaults;
+
+        if (cfg == nullptr) {
+            client_config_init(&defaults);
+            cfg = &defaults;
+        }
+        uds_client_t *c = client_init_config(path, cfg);
+        if (c == nullptr) {
+            throw std::runtime_error(std::string("uds: can't connect to ") +
+                                     path);
+        }
+        return c;
+    }
+
+    /* Append the request to the output buffer */
+    bool encode(std::uint32_t command, bytes payload) noexcept
+    {
+        std::size_t len = sizeof(uds_command_t) + payload.size();
+        std::size_t pos = out_.size();
+
+        if (broken_ || (len > c_->config.buf_size)) {
+            return false;
+        }
+        try {
+            out_.resize(pos + len);
+        } catch (const std::bad_alloc &) {
+            return false;
+        }
+        std::uint8_t *p = out_.data() + pos;
+        std::memset(p, 0, sizeof(uds_command_t));
+        detail::put_uint(p, UDS_SIGNATURE, 4);
+        detail::put_uint(p + 4, command, 4);
+        detail::put_uint(p + 8, static_cast<std::uint32_t>(payload.size()), 4);
+        if (!payload.empty()) {
+            std::memcpy(p + sizeof(uds_command_t), payload.data(),
+                        payload.size());
+        }
+        detail::put_uint(p + 12, detail::checksum(p, len), 2);
+        return true;
+    }
+
+    void enqueue(CallAwaiter *a) noexcept
+    {
+        if (tail_ != nullptr) {
+            tail_->next_ = a;
+        } else {
+            head_ = a;
+        }
+        tail_ = a;
+        npending_++;
+        flush();
+    }
+
+    /* Send the output buffer until the socket is full */
+    void flush() noexcept
+    {
+        while (out_off_ < out_.size()) {
+            ssize_t n = send(c_->sockfd, out_.data() + out_off_,
+                             out_.size() - out_off_, MSG_NOSIGNAL);
+            if (n > 0) {
+                out_off_ += n;
+            } else if ((n < 0) && (errno == EINTR)) {
+                continue;
+            } else {
+                if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                    broken_ = true;
+                }
+                return;
+            }
+        }
+        out_.clear();   /* Keeps the capacity */
+        out_off_ = 0;
+    }
+
+    /* Receive the responses and complete the calls in order */
+    void receive()
+    {
+        const std::size_t hdr = sizeof(uds_command_t);
+
+        while (!broken_) {
+            ssize_t n = recv(c_->sockfd, in_.data() + in_len_,
+                             in_.size() - in_len_, 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                    broken_ = true;
+                }
+                break;
+            } else if (n == 0) {
+                broken_ = true;
+                break;
+            }
+            in_len_ += n;
+
+            /* Complete a call for each whole packet */
+            std::size_t pos = 0;
+            while (in_len_ - pos >= hdr) {
+                const uds_command_t *pkt =
+                    reinterpret_cast<const uds_command_t *>(in_.data() + pos);
+                std::size_t len = hdr + pkt->data_len;
+                if ((pkt->signature != UDS_SIGNATURE) ||
+                        (len > buffers_.size()) || (head_ == nullptr)) {
+                    broken_ = true;
+                    break;
+                }
+                if (in_len_ - pos < len) {
+                    break;
+                }
+                if (detail::checksum(in_.data() + pos, len) == 0) {
+                    std::uint8_t *buf = buffers_.get();
+                    std::memcpy(buf, in_.data() + pos, len);
+                    complete(PooledResponse(&buffers_, buf));
+                } else {
+                    complete(PooledResponse());
+                }
+                pos += len;
+            }
+            if (pos > 0) {
+                std::memmove(in_.data(), in_.data() + pos, in_len_ - pos);
+                in_len_ -= pos;
+            }
+        }
+
+        /* The connection is lost, fail all pending calls */
+        while (broken_ && (head_ != nullptr)) {
+            complete(PooledResponse());
+        }
+    }
+
+    void complete(PooledResponse &&resp)
+    {
+        CallAwaiter *a = head_;
+        head_ = a->next_;
+        if (head_ == nullptr) {
+            tail_ = nullptr;
+        }
+        npending_--;
+        a->resp_ = std::move(resp);
+        ex_.post(a->h_);
+    }
+
+    void on_event(std::uint32_t events)
+    {
+        if (events & EPOLLOUT) {
+            flush();
+        }
+        if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            receive();
+        }
+    }
+
+    Reactor &reactor_;
+    Executor ex_;
+    uds_client_t *c_;
+    FramePool frames_;
+    BufferPool buffers_;
+    /* Requests not sent yet */
+    std::pmr::vector<std::uint8_t> out_{library_resource()};
+    std::size_t out_off_ = 0;           /* Bytes of out_ sent */
+    /* Responses being received */
+    std::pmr::vector<std::uint8_t> in_;
+    std::size_t in_len_ = 0;            /* Bytes in in_ */
+    CallAwaiter *head_ = nullptr;       /* Pending calls, oldest first */
+    CallAwaiter *tail_ = nullptr;
+    std::size_t npending_ = 0;
+    bool broken_ = false;               /* The connection failed */
+};
+
+
+inline int Reactor::run_once(int timeout_ms)
+{
+    struct epoll_event ev[16];
+    int count;
+
+    count = epoll_wait(epfd_, ev, 16, timeout_ms);
+    for (int i = 0; i < count; i++) {
+        static_cast<AsyncClient *>(ev[i].data.ptr)->on_event(ev[i].events);
+    }
+    return (count > 0) ? count : 0;
+}
+
+
+namespace detail {
+
+template <class... Args>
+void *promise_base::operator new(std::size_t n, AsyncClient &c, Args &&...)
+{
+    return FramePool::allocate(&c.frames(), n);
+}
+
+template <class This, class... Args, class>
+void *promise_base::operator new(std::size_t n, This &, AsyncClient &c,
+                                 Args &&...)
+{
+    return FramePool::allocate(&c.frames(), n);
+}
+
+} // namespace detail
+
+} // namespace uds
+
+
+#endif /* _UDS_CORO_HPP_ */
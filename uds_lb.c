@@ -0,0 +1,668 @@
+/******************************************************************************
+*
+* FILENAME:
+*     uds_lb.c
+*
+* DESCRIPTION:
+*     Client balancing the requests across several identical servers.
+*
+* REVISION(MM/DD/YYYY):
+*     10/18/2026
+*     - Initial version
+*
+******************************************************************************/
+#define _GNU_SOURCE     /* ppoll() */
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "uds_lb.h"
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_now_ns
+ *
+ * DESCRIPTION:
+ *      Get the time of monotonic clock.
+ *
+ * PARAMETERS:
+ *      None
+ *
+ * RETURN:
+ *      The time in nanoseconds.
+ ******************************************************************************/
+static int64_t lb_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_random
+ *
+ * DESCRIPTION:
+ *      Get a random number for the choices, lock-free.
+ *
+ * PARAMETERS:
+ *      lb - The balancer
+ *
+ * RETURN:
+ *      The random number.
+ ******************************************************************************/
+static uint32_t lb_random(uds_lb_t *lb)
+{
+    uint32_t x;
+
+    x = __atomic_add_fetch(&lb->seed, 0x9E3779B9, __ATOMIC_RELAXED);
+    x ^= x >> 16;
+    x *= 0x85EBCA6B;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35;
+    x ^= x >> 16;
+    return x;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_cost
+ *
+ * DESCRIPTION:
+ *      Expected wait of a new request on an endpoint: the requests in
+ *      flight with it, by the recent latency.
+ *
+ * PARAMETERS:
+ *      ep - The endpoint
+ *
+ * RETURN:
+ *      The cost.
+ ******************************************************************************/
+static int64_t lb_cost(uds_lb_endpoint_t *ep)
+{
+    return (__atomic_load_n(&ep->inflight, __ATOMIC_RELAXED) + 1) *
+        __atomic_load_n(&ep->latency, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_pick
+ *
+ * DESCRIPTION:
+ *      Pick an endpoint not tried yet: the cheaper of two random ones which
+ *      are up and not waiting for a dropped response, the next request on
+ *      such one waits for the response which is slow already. If there is
+ *      none of them, try the others anyway.
+ *
+ * PARAMETERS:
+ *      lb    - The balancer
+ *      tried - Bit mask of the endpoints tried
+ *
+ * RETURN:
+ *      Index of the endpoint, -1 if all are tried.
+ ******************************************************************************/
+static int lb_pick(uds_lb_t *lb, uint32_t tried)
+{
+    int cand[UDS_LB_MAX_ENDPOINTS];
+    int i, n, a, b;
+    int64_t now;
+    uint32_t r;
+
+    now = lb_now_ns();
+    n = 0;
+    for (i = 0; i < lb->count; i++) {
+        if (!(tried & (1u << i)) && (now >=
+                __atomic_load_n(&lb->ep[i].down_until, __ATOMIC_RELAXED)) &&
+                (__atomic_load_n(&lb->ep[i].drain, __ATOMIC_RELAXED) == 0)) {
+            cand[n++] = i;
+        }
+    }
+    if (n == 0) {
+        for (i = 0; i < lb->count; i++) {
+            if (!(tried & (1u << i))) {
+                cand[n++] = i;
+            }
+        }
+    }
+
+    if (n <= 1) {
+        return (n == 1) ? cand[0] : -1;
+    }
+
+    r = lb_random(lb);
+    a = r % n;
+    b = (r >> 16) % (n - 1);
+    if (b >= a) {
+        b++;
+    }
+    return (lb_cost(&lb->ep[cand[a]]) <= lb_cost(&lb->ep[cand[b]])) ?
+        cand[a] : cand[b];
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_latency_update
+ *
+ * DESCRIPTION:
+ *      Add the latency of a request to the average latency of an endpoint.
+ *
+ * PARAMETERS:
+ *      ep      - The endpoint
+ *      latency - Latency of the request(ns)
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void lb_latency_update(uds_lb_endpoint_t *ep, int64_t latency)
+{
+    int64_t avg;
+
+    avg = __atomic_load_n(&ep->latency, __ATOMIC_RELAXED);
+    avg += (latency - avg) / 8;
+    __atomic_store_n(&ep->latency, avg, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_report
+ *
+ * DESCRIPTION:
+ *      Track the health and the latency of an endpoint after a request.
+ *
+ * PARAMETERS:
+ *      lb      - The balancer
+ *      ep      - The endpoint
+ *      ok      - 1: the request is answered, 0: failed
+ *      latency - Latency of the request(ns)
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void lb_report(uds_lb_t *lb, uds_lb_endpoint_t *ep, int ok,
+    int64_t latency)
+{
+    uint32_t seq;
+
+    if (ok) {
+        __atomic_store_n(&ep->failures, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ep->requests, 1, __ATOMIC_RELAXED);
+        lb_latency_update(ep, latency);
+        seq = __atomic_fetch_add(&lb->sample_seq, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&lb->samples[seq % UDS_LB_SAMPLES], latency,
+            __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_add_fetch(&ep->errors, 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&ep->failures, 1, __ATOMIC_RELAXED) >=
+            UDS_LB_MAX_FAILURES) {
+        __atomic_store_n(&ep->down_until,
+            lb_now_ns() + UDS_LB_DOWN_MS * 1000000LL, __ATOMIC_RELAXED);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_disconnect
+ *
+ * DESCRIPTION:
+ *      Close the connection of an endpoint, the responses to drop are gone
+ *      with it. Called with the lock of endpoint held.
+ *
+ * PARAMETERS:
+ *      ep - The endpoint
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void lb_disconnect(uds_lb_endpoint_t *ep)
+{
+    client_close(ep->clnt);
+    ep->clnt = NULL;
+    __atomic_sub_fetch(&ep->inflight, ep->drain, __ATOMIC_RELAXED);
+    __atomic_store_n(&ep->drain, 0, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_drop_response
+ *
+ * DESCRIPTION:
+ *      Receive and drop the response of an abandoned request. Called with
+ *      the lock of endpoint held.
+ *
+ * PARAMETERS:
+ *      ep - The endpoint
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void lb_drop_response(uds_lb_endpoint_t *ep)
+{
+    uds_command_t *resp;
+
+    resp = client_recv_response(ep->clnt);
+    if (resp == NULL) {
+        lb_disconnect(ep);
+        return;
+    }
+    uds_free(resp);
+    __atomic_sub_fetch(&ep->drain, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&ep->inflight, 1, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_collect
+ *
+ * DESCRIPTION:
+ *      Drop the responses of abandoned requests which have arrived, so the
+ *      endpoints avoided for them can be picked again. It doesn't wait.
+ *
+ * PARAMETERS:
+ *      lb - The balancer
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void lb_collect(uds_lb_t *lb)
+{
+    uds_lb_endpoint_t *ep;
+    struct pollfd pfd;
+    int i;
+
+    for (i = 0; i < lb->count; i++) {
+        ep = &lb->ep[i];
+        if ((__atomic_load_n(&ep->drain, __ATOMIC_RELAXED) == 0) ||
+                (pthread_mutex_trylock(&ep->lock) != 0)) {
+            continue;
+        }
+        while ((ep->clnt != NULL) && (ep->drain > 0)) {
+            pfd.fd = ep->clnt->sockfd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 0) <= 0) {
+                break;
+            }
+            lb_drop_response(ep);
+        }
+        pthread_mutex_unlock(&ep->lock);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_prepare
+ *
+ * DESCRIPTION:
+ *      Make the connection of an endpoint ready for a request: connect it,
+ *      or drop the responses of abandoned requests, which come first.
+ *      Called with the lock of endpoint held.
+ *
+ * PARAMETERS:
+ *      lb - The balancer
+ *      ep - The endpoint
+ *
+ * RETURN:
+ *      0 - OK, Others - Not connected
+ ******************************************************************************/
+static int lb_prepare(uds_lb_t *lb, uds_lb_endpoint_t *ep)
+{
+    while ((ep->clnt != NULL) && (ep->drain > 0)) {
+        lb_drop_response(ep);
+    }
+
+    if (ep->clnt == NULL) {
+        ep->clnt = client_init_config(ep->path, &lb->config);
+    }
+
+    return (ep->clnt != NULL) ? 0 : -1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_compare_latency
+ *
+ * DESCRIPTION:
+ *      Compare two latencies for qsort().
+ ******************************************************************************/
+static int lb_compare_latency(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_hedge_delay
+ *
+ * DESCRIPTION:
+ *      Get the time to wait before sending a backup request: the percentile
+ *      of recent latencies.
+ *
+ * PARAMETERS:
+ *      lb - The balancer
+ *
+ * RETURN:
+ *      The time(ns), -1 if too few latencies are sampled.
+ ******************************************************************************/
+static int64_t lb_hedge_delay(uds_lb_t *lb)
+{
+    int64_t samples[UDS_LB_SAMPLES];
+    uint32_t i, n;
+
+    n = __atomic_load_n(&lb->sample_seq, __ATOMIC_RELAXED);
+    if (n < UDS_LB_SAMPLES / 4) {
+        return -1;
+    }
+    n = (n < UDS_LB_SAMPLES) ? n : UDS_LB_SAMPLES;
+    for (i = 0; i < n; i++) {
+        samples[i] = __atomic_load_n(&lb->samples[i], __ATOMIC_RELAXED);
+    }
+    qsort(samples, n, sizeof(int64_t), lb_compare_latency);
+
+    i = n * lb->hedge_percentile / 100;
+    return samples[(i < n) ? i : n - 1];
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_init
+ *
+ * DESCRIPTION:
+ *      Init a balancer of endpoints. The connections are made when they are
+ *      used first, so a server can be started later.
+ *
+ * PARAMETERS:
+ *      paths - Socket paths of the servers
+ *      count - Count of the paths
+ *      cfg   - The configuration of connections, NULL: the default one
+ *
+ * RETURN:
+ *      The balancer, NULL if failed.
+ ******************************************************************************/
+uds_lb_t *lb_init(const char *const paths[], int count,
+    const uds_client_config_t *cfg)
+{
+    uds_lb_t *lb;
+    int i;
+
+    if ((paths == NULL) || (count <= 0) || (count > UDS_LB_MAX_ENDPOINTS)) {
+        printf("Error: invalid parameter!\n");
+        return NULL;
+    }
+
+    lb = (uds_lb_t *)uds_malloc(sizeof(uds_lb_t));
+    if (lb == NULL) {
+        perror("malloc error");
+        return NULL;
+    }
+    memset(lb, 0, sizeof(uds_lb_t));
+    if (cfg != NULL) {
+        lb->config = *cfg;
+    } else {
+        client_config_init(&lb->config);
+    }
+    lb->seed = (uint32_t)lb_now_ns() ^ (uint32_t)getpid();
+    lb->hedge_percentile = UDS_LB_HEDGE_PERCENTILE;
+
+    for (i = 0; i < count; i++) {
+        lb->ep[i].path = (char *)uds_malloc(strlen(paths[i]) + 1);
+        if (lb->ep[i].path == NULL) {
+            perror("malloc error");
+            lb_close(lb);
+            return NULL;
+        }
+        strcpy(lb->ep[i].path, paths[i]);
+        pthread_mutex_init(&lb->ep[i].lock, NULL);
+        lb->ep[i].latency = UDS_LB_INIT_LATENCY;
+        lb->count++;
+    }
+
+    return lb;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_send_request
+ *
+ * DESCRIPTION:
+ *      Send a request to one of the endpoints, and get the response. If the
+ *      request can't be sent (e.g. the server is gone), it is sent to
+ *      another endpoint. A request sent but not answered is not sent
+ *      again, as it may be handled already.
+ *
+ * PARAMETERS:
+ *      lb  - The balancer
+ *      req - The request to send
+ *
+ * RETURN:
+ *      The response for the request. The caller need to free the memory by
+ *      uds_free().
+ ******************************************************************************/
+uds_command_t *lb_send_request(uds_lb_t *lb, uds_command_t *req)
+{
+    uds_lb_endpoint_t *ep;
+    uds_command_t *resp;
+    uint32_t tried = 0;
+    int64_t t0;
+    int i, sent;
+
+    if ((lb == NULL) || (req == NULL)) {
+        printf("Error: invalid parameter!\n");
+        return NULL;
+    }
+
+    lb_collect(lb);
+    while ((i = lb_pick(lb, tried)) >= 0) {
+        tried |= 1u << i;
+        ep = &lb->ep[i];
+        sent = 0;
+        resp = NULL;
+
+        __atomic_add_fetch(&ep->inflight, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&ep->lock);
+        t0 = 0;
+        if (lb_prepare(lb, ep) == 0) {
+            t0 = lb_now_ns();
+            if (client_post_request(ep->clnt, req) == 0) {
+                sent = 1;
+                resp = client_recv_response(ep->clnt);
+            }
+            if (resp == NULL) {
+                lb_disconnect(ep);
+            }
+        }
+        pthread_mutex_unlock(&ep->lock);
+        __atomic_sub_fetch(&ep->inflight, 1, __ATOMIC_RELAXED);
+
+        lb_report(lb, ep, resp != NULL, lb_now_ns() - t0);
+        if ((resp != NULL) || sent) {
+            return resp;
+        }
+    }
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_send_hedged
+ *
+ * DESCRIPTION:
+ *      Send an idempotent request to one of the endpoints, and get the
+ *      response. If it is not answered within the hedge_percentile of
+ *      recent latency, send a backup request to another endpoint, and use
+ *      the response which comes first. The other response is dropped when
+ *      its connection is used next time.
+ *
+ * PARAMETERS:
+ *      lb  - The balancer
+ *      req - The request to send, it shall be safe to handle twice
+ *
+ * RETURN:
+ *      The response for the request. The caller need to free the memory by
+ *      uds_free().
+ ******************************************************************************/
+uds_command_t *lb_send_hedged(uds_lb_t *lb, uds_command_t *req)
+{
+    uds_lb_endpoint_t *ep[2];
+    uds_command_t *resp;
+    struct pollfd pfd[2];
+    struct timespec ts;
+    int64_t t[2], delay;
+    int i, j, k, nep, pending[2];
+
+    if ((lb == NULL) || (req == NULL)) {
+        printf("Error: invalid parameter!\n");
+        return NULL;
+    }
+
+    /* The first request, fail over as lb_send_request() if it can't send */
+    lb_collect(lb);
+    i = lb_pick(lb, 0);
+    if (i < 0) {
+        return NULL;
+    }
+    ep[0] = &lb->ep[i];
+    __atomic_add_fetch(&ep[0]->inflight, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&ep[0]->lock);
+    if ((lb_prepare(lb, ep[0]) != 0) ||
+            (client_post_request(ep[0]->clnt, req) != 0)) {
+        lb_disconnect(ep[0]);
+        pthread_mutex_unlock(&ep[0]->lock);
+        __atomic_sub_fetch(&ep[0]->inflight, 1, __ATOMIC_RELAXED);
+        lb_report(lb, ep[0], 0, 0);
+        return lb_send_request(lb, req);
+    }
+    t[0] = lb_now_ns();
+    nep = 1;
+
+    /* Wait for the percentile of latency, then send a backup request to
+     * an endpoint not busy, nor waiting for a dropped response */
+    delay = lb_hedge_delay(lb);
+    pfd[0].fd = ep[0]->clnt->sockfd;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    ts.tv_sec = delay / 1000000000LL;
+    ts.tv_nsec = delay % 1000000000LL;
+    if ((delay >= 0) && (lb->count > 1) &&
+            (ppoll(pfd, 1, &ts, NULL) == 0) &&
+            ((j = lb_pick(lb, 1u << i)) >= 0) &&
+            (pthread_mutex_trylock(&lb->ep[j].lock) == 0)) {
+        ep[1] = &lb->ep[j];
+        __atomic_add_fetch(&ep[1]->inflight, 1, __ATOMIC_RELAXED);
+        if ((ep[1]->drain == 0) && (lb_prepare(lb, ep[1]) == 0) &&
+                (client_post_request(ep[1]->clnt, req) == 0)) {
+            t[1] = lb_now_ns();
+            __atomic_add_fetch(&lb->hedges, 1, __ATOMIC_RELAXED);
+            pfd[1].fd = ep[1]->clnt->sockfd;
+            pfd[1].events = POLLIN;
+            pfd[1].revents = 0;
+            nep = 2;
+        } else {
+            if (ep[1]->drain == 0) {
+                lb_disconnect(ep[1]);
+            }
+            pthread_mutex_unlock(&ep[1]->lock);
+            __atomic_sub_fetch(&ep[1]->inflight, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Take the first response, or the other one if the first fails */
+    pending[0] = 1;
+    pending[1] = (nep == 2);
+    k = 0;
+    if (nep == 2) {
+        while ((poll(pfd, 2, -1) < 0) && (errno == EINTR)) {
+            continue;
+        }
+        k = ((pfd[0].revents == 0) && (pfd[1].revents != 0)) ? 1 : 0;
+    }
+    resp = client_recv_response(ep[k]->clnt);
+    pending[k] = 0;
+    lb_report(lb, ep[k], resp != NULL, lb_now_ns() - t[k]);
+    if ((resp == NULL) && pending[1 - k]) {
+        lb_disconnect(ep[k]);
+        k = 1 - k;
+        resp = client_recv_response(ep[k]->clnt);
+        pending[k] = 0;
+        lb_report(lb, ep[k], resp != NULL, lb_now_ns() - t[k]);
+    }
+    if (resp == NULL) {
+        lb_disconnect(ep[k]);
+    } else if (k == 1) {
+        __atomic_add_fetch(&lb->hedge_wins, 1, __ATOMIC_RELAXED);
+
+        /* The primary still pending is at least this slow, but it is not
+         * a sample of the percentile */
+        if (pending[0]) {
+            lb_latency_update(ep[0], lb_now_ns() - t[0]);
+        }
+    }
+
+    /* The response of the other request is dropped later, it is still in
+     * flight until then */
+    for (i = 0; i < nep; i++) {
+        if (pending[i]) {
+            __atomic_add_fetch(&ep[i]->drain, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_sub_fetch(&ep[i]->inflight, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&ep[i]->lock);
+    }
+
+    return resp;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lb_close
+ *
+ * DESCRIPTION:
+ *      Close the connections of a balancer and free it.
+ *
+ * PARAMETERS:
+ *      lb - The balancer
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void lb_close(uds_lb_t *lb)
+{
+    int i;
+
+    if (lb == NULL) {
+        return;
+    }
+
+    for (i = 0; i < lb->count; i++) {
+        if (lb->ep[i].clnt != NULL) {
+            client_close(lb->ep[i].clnt);
+        }
+        pthread_mutex_destroy(&lb->ep[i].lock);
+    }
+    for (i = 0; i < UDS_LB_MAX_ENDPOINTS; i++) {
+        uds_free(lb->ep[i].path);
+    }
+    uds_free(lb);
+}
@@ -0,0 +1,92 @@
+/******************************************************************************
+*
+* FILENAME:
+*     uds_lb.h
+*
+* DESCRIPTION:
+*     Client balancing the requests across several identical servers, each
+*     on its own socket path. A request goes to the better of two endpoints
+*     picked at random (power of two choices), comparing the requests in
+*     flight weighted by the recent latency. An endpoint failing in a row
+*     is left out for a while, and a request which can't be sent fails over
+*     to another endpoint.
+*
+*     An idempotent request can be hedged: if it is not answered within a
+*     percentile of recent latency, a backup is sent to another endpoint,
+*     the first response is used and the other one is dropped later.
+*
+* REVISION(MM/DD/YYYY):
+*     10/18/2026
+*     - Initial version
+*
+******************************************************************************/
+#ifndef _UDS_LB_H_
+#define _UDS_LB_H_
+#include "uds.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Max count of endpoints of a balancer */
+#define UDS_LB_MAX_ENDPOINTS    16
+
+/* Failures in a row to take an endpoint as down */
+#define UDS_LB_MAX_FAILURES     3
+
+/* How long an endpoint is left out after it is down(ms) */
+#define UDS_LB_DOWN_MS          1000
+
+/* Latency assumed of an endpoint before its first response(ns) */
+#define UDS_LB_INIT_LATENCY     100000
+
+/* Count of recent latencies to compute the percentile of hedging */
+#define UDS_LB_SAMPLES          128
+
+/* The default percentile of latency to send a backup request */
+#define UDS_LB_HEDGE_PERCENTILE 95
+
+
+/* A server endpoint */
+typedef struct uds_lb_endpoint {
+    char *path;                 /* Socket path of the server */
+    pthread_mutex_t lock;       /* One request at a time on the connection */
+    uds_client_t *clnt;         /* The connection, NULL: not connected */
+    int inflight;               /* Requests sent or waiting for the lock */
+    int failures;               /* Failures in a row */
+    int drain;                  /* Responses of abandoned requests to drop
+                                   before the next one, changed under lock */
+    int64_t latency;            /* Recent latency of requests(ns), EWMA */
+    int64_t down_until;         /* Left out until this time(ns) */
+    uint64_t requests;          /* Requests answered */
+    uint64_t errors;            /* Requests failed */
+} uds_lb_endpoint_t;
+
+/* A client balancing across endpoints, it can be used by many threads */
+typedef struct uds_lb {
+    uds_client_config_t config;         /* Config of the connections */
+    uds_lb_endpoint_t ep[UDS_LB_MAX_ENDPOINTS];     /* The endpoints */
+    int count;                          /* Count of endpoints */
+    uint32_t seed;                      /* Seed of random choices */
+    int hedge_percentile;               /* Percentile of latency to send a
+                                           backup request, 1~99 */
+    int64_t samples[UDS_LB_SAMPLES];    /* Recent latencies(ns), a ring */
+    uint32_t sample_seq;                /* Count of latencies sampled */
+    uint64_t hedges;                    /* Backup requests sent */
+    uint64_t hedge_wins;                /* Backup requests answered first */
+} uds_lb_t;
+
+
+uds_lb_t *lb_init(const char *const paths[], int count,
+    const uds_client_config_t *cfg);
+uds_command_t *lb_send_request(uds_lb_t *lb, uds_command_t *req);
+uds_command_t *lb_send_hedged(uds_lb_t *lb, uds_command_t *req);
+void lb_close(uds_lb_t *lb);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UDS_LB_H_ */
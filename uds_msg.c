@@ -0,0 +1,359 @@
+/******************************************************************************
+*
+* FILENAME:
+*     uds_msg.c
+*
+* DESCRIPTION:
+*     Messages with variable-length fields in the payload of a packet.
+*
+* REVISION(MM/DD/YYYY):
+*     10/18/2026
+*     - Initial version
+*
+******************************************************************************/
+#include "uds_msg.h"
+
+
+/******************************************************************************
+ * NAME:
+ *      msg_view_init
+ *
+ * DESCRIPTION:
+ *      Validate the field table of a received packet, and make a view of
+ *      the message. Every field shall be inside the payload, so the
+ *      accessors don't check the bounds any more.
+ *
+ * PARAMETERS:
+ *      m   - Return the view
+ *      pkt - The packet, it shall be verified by the library already
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int msg_view_init(uds_msg_t *m, const uds_command_t *pkt)
+{
+    const uint8_t *payload = (const uint8_t *)(pkt + 1);
+    uds_msg_header_t hdr;
+    uds_msg_field_t f;
+    uint32_t size = pkt->data_len;
+    uint32_t table;
+    unsigned int i;
+
+    if (size < sizeof(uds_msg_header_t)) {
+        return -1;
+    }
+    memcpy(&hdr, payload, sizeof(hdr));
+    table = UDS_MSG_TABLE_SIZE((uint32_t)hdr.count);
+    if (table > size) {
+        return -1;
+    }
+
+    for (i = 0; i < hdr.count; i++) {
+        memcpy(&f, payload + UDS_MSG_TABLE_SIZE(i), sizeof(f));
+        if ((f.len != 0) && ((f.offset < table) || (f.offset > size) ||
+                (f.len > size - f.offset))) {
+            return -1;
+        }
+    }
+
+    m->payload = payload;
+    m->fields = (const uds_msg_field_t *)(payload + UDS_MSG_TABLE_SIZE(0));
+    m->count = hdr.count;
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      msg_get_bytes
+ *
+ * DESCRIPTION:
+ *      Get a field of message, pointing into the receive buffer.
+ *
+ * PARAMETERS:
+ *      m     - The view of message
+ *      field - Index of the field
+ *      len   - Return the length of field
+ *
+ * RETURN:
+ *      The data of field, NULL if it is absent.
+ ******************************************************************************/
+const void *msg_get_bytes(const uds_msg_t *m, unsigned int field,
+    uint32_t *len)
+{
+    uds_msg_field_t f;
+
+    if (field >= m->count) {
+        return NULL;
+    }
+    memcpy(&f, &m->fields[field], sizeof(f));
+    if (f.len == 0) {
+        return NULL;
+    }
+
+    *len = f.len;
+    return m->payload + f.offset;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      msg_get_string
+ *
+ * DESCRIPTION:
+ *      Get a string field of message. Strings are kept with the NUL.
+ *
+ * PARAMETERS:
+ *      m     - The view of message
+ *      field - Index of the field
+ *
+ * RETURN:
+ *      The string, NULL if it is absent or not terminated.
+ ******************************************************************************/
+const char *msg_get_string(const uds_msg_t *m, unsigned int field)
+{
+    const char *str;
+    uint32_t len;
+
+    str = (const char *)msg_get_bytes(m, field, &len);
+    if ((str == NULL) || (str[len-1] != '\0')) {
+        return NULL;
+    }
+
+    return str;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      msg_get_u32
+ *
+ * DESCRIPTION:
+ *      Get a 32 bits integer field of message.
+ *
+ * PARAMETERS:
+ *      m     - The view of message
+ *      field - Index of the field
+ *      value - Return the value
+ *
+ * RETURN:
+ *      0 - OK, Others - The field is absent or has another type
+ ******************************************************************************/
+int msg_get_u32(const uds_msg_t *m, unsigned int field, uint32_t *value)
+{
+    const void *p;
+    uint32_t len;
+
+    p = msg_get_bytes(m, field, &len);
+    if ((p == NULL) || (len != sizeof(*value))) {
+        return -1;
+    }
+
+    memcpy(value, p, sizeof(*value));
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      msg_get_u64
+ *
+ * DESCRIPTION:
+ *      Get a 64 bits integer field of message.
+ *
+ * PARAMETERS:
+ *      m     - The view of message
+ *      field - Index of the field
+ *      value - Return the value
+ *
+ * RETURN:
+ *      0 - OK, Others - The field is absent or has another type
+ ******************************************************************************/
+int msg_get_u64(const uds_msg_t *m, unsigned int field, uint64_t *value)
+{
+    const void *p;
+    uint32_t len;
+
+    p = msg_get_bytes(m, field, &len);
+    if ((p == NULL) || (len != sizeof(*value))) {
+        return -1;
+    }
+
+    memcpy(value, p, sizeof(*value));
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      msg_builder_init
+ *
+ * DESCRIPTION:
+ *      Start to build a message in a buffer, all fields are absent. The
+ *      fields can be added in any order.
+ *
+ * PARAMETERS:
+ *      b       - The builder
+ *      buf     - The buffer of packet, e.g. a response to return
+ *      size    - Size of the buffer
+ *      command - The command of request, or the status of response
+ *      count   - Count of fields in the schema
+ *
+ * RETURN:
+ *      0 - OK, Others - The buffer is too small
+ ******************************************************************************/
+int msg_builder_init(uds_msg_builder_t *b, void *buf, size_t size,
+    uint32_t command, unsigned int count)
+{
+    uds_msg_header_t hdr;
+    uint8_t *payload;
+
+    memset(b, 0, sizeof(uds_msg_builder_t));
+    if ((buf == NULL) || (count > UINT16_MAX) ||
+            (size < sizeof(uds_command_t) + UDS_MSG_TABLE_SIZE(count))) {
+        b->error = 1;
+        return -1;
+    }
+
+    b->pkt = (uds_command_t *)buf;
+    b->size = size;
+    b->count = (uint16_t)count;
+    b->used = UDS_MSG_TABLE_SIZE(count);
+
+    memset(b->pkt, 0, sizeof(uds_command_t));
+    b->pkt->command = command;
+    payload = (uint8_t *)(b->pkt + 1);
+    hdr.count = b->count;
+    hdr.reserved = 0;
+    memcpy(payload, &hdr, sizeof(hdr));
+    memset(payload + sizeof(hdr), 0, b->used - sizeof(hdr));
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      msg_add_bytes
+ *
+ * DESCRIPTION:
+ *      Append the data of a field to the message.
+ *
+ * PARAMETERS:
+ *      b     - The builder
+ *      field - Index of the field
+ *      data  - The data of field
+ *      len   - Length of the data
+ *
+ * RETURN:
+ *      0 - OK, Others - Error, msg_builder_finish() will fail too
+ ******************************************************************************/
+int msg_add_bytes(uds_msg_builder_t *b, unsigned int field,
+    const void *data, uint32_t len)
+{
+    uint8_t *payload;
+    uds_msg_field_t f;
+
+    if (b->error || (field >= b->count) ||
+            (len > b->size - sizeof(uds_command_t) - b->used)) {
+        b->error = 1;
+        return -1;
+    }
+
+    payload = (uint8_t *)(b->pkt + 1);
+    f.offset = b->used;
+    f.len = len;
+    memcpy(payload + f.offset, data, len);
+    memcpy(payload + UDS_MSG_TABLE_SIZE(field), &f, sizeof(f));
+    b->used += len;
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      msg_add_string
+ *
+ * DESCRIPTION:
+ *      Append a string field with its NUL to the message.
+ *
+ * PARAMETERS:
+ *      b     - The builder
+ *      field - Index of the field
+ *      str   - The string
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int msg_add_string(uds_msg_builder_t *b, unsigned int field,
+    const char *str)
+{
+    return msg_add_bytes(b, field, str, strlen(str) + 1);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      msg_add_u32
+ *
+ * DESCRIPTION:
+ *      Append a 32 bits integer field to the message.
+ *
+ * PARAMETERS:
+ *      b     - The builder
+ *      field - Index of the field
+ *      value - The value
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int msg_add_u32(uds_msg_builder_t *b, unsigned int field, uint32_t value)
+{
+    return msg_add_bytes(b, field, &value, sizeof(value));
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      msg_add_u64
+ *
+ * DESCRIPTION:
+ *      Append a 64 bits integer field to the message.
+ *
+ * PARAMETERS:
+ *      b     - The builder
+ *      field - Index of the field
+ *      value - The value
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int msg_add_u64(uds_msg_builder_t *b, unsigned int field, uint64_t value)
+{
+    return msg_add_bytes(b, field, &value, sizeof(value));
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      msg_builder_finish
+ *
+ * DESCRIPTION:
+ *      Finish the message, set the data length of packet.
+ *
+ * PARAMETERS:
+ *      b - The builder
+ *
+ * RETURN:
+ *      The packet, NULL if any field failed to add.
+ ******************************************************************************/
+uds_command_t *msg_builder_finish(uds_msg_builder_t *b)
+{
+    if (b->error) {
+        return NULL;
+    }
+
+    b->pkt->data_len = b->used;
+    return b->pkt;
+}
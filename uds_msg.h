@@ -0,0 +1,92 @@
+/******************************************************************************
+*
+* FILENAME:
+*     uds_msg.h
+*
+* DESCRIPTION:
+*     Messages with variable-length fields in the payload of a packet. The
+*     payload starts with a table of (offset, length) of each field:
+*
+*       +-------+----------+--------------------+-----+----------------+
+*       | count | reserved | offset[0], len[0]  | ... | data of fields |
+*       +-------+----------+--------------------+-----+----------------+
+*        16 bits  16 bits    32 bits, 32 bits
+*
+*     The offsets are relative to the payload. A field with length 0 is
+*     absent. The table is validated once by msg_view_init(), then the
+*     fields are read from the receive buffer in O(1), without copy.
+*
+*     Fields are identified by index, the schema of a command is an enum
+*     of its field indexes (see common.h). A reader of an older schema
+*     ignores the fields it doesn't know, a new field is absent to it.
+*
+* REVISION(MM/DD/YYYY):
+*     10/18/2026
+*     - Initial version
+*
+******************************************************************************/
+#ifndef _UDS_MSG_H_
+#define _UDS_MSG_H_
+#include "uds.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Entry of the field table */
+typedef struct uds_msg_field {
+    uint32_t offset;            /* Offset of the field in payload */
+    uint32_t len;               /* Length of the field, 0: absent */
+} BYTE_ALIGNED uds_msg_field_t;
+
+/* Header of the payload of a message */
+typedef struct uds_msg_header {
+    uint16_t count;             /* Count of fields in the table */
+    uint16_t reserved;
+} BYTE_ALIGNED uds_msg_header_t;
+
+/* Bytes of the payload used by a table of n fields */
+#define UDS_MSG_TABLE_SIZE(n)   \
+    (sizeof(uds_msg_header_t) + (n) * sizeof(uds_msg_field_t))
+
+/* A validated message in a received packet */
+typedef struct uds_msg {
+    const uint8_t *payload;             /* Payload of the packet */
+    const uds_msg_field_t *fields;      /* Field table, maybe unaligned */
+    uint16_t count;                     /* Count of fields */
+} uds_msg_t;
+
+/* Build a message in a buffer */
+typedef struct uds_msg_builder {
+    uds_command_t *pkt;         /* The packet being built */
+    size_t size;                /* Size of the buffer of packet */
+    uint32_t used;              /* Bytes of payload used */
+    uint16_t count;             /* Count of fields */
+    int error;                  /* 1: a field didn't fit or bad index */
+} uds_msg_builder_t;
+
+
+int msg_view_init(uds_msg_t *m, const uds_command_t *pkt);
+const void *msg_get_bytes(const uds_msg_t *m, unsigned int field,
+    uint32_t *len);
+const char *msg_get_string(const uds_msg_t *m, unsigned int field);
+int msg_get_u32(const uds_msg_t *m, unsigned int field, uint32_t *value);
+int msg_get_u64(const uds_msg_t *m, unsigned int field, uint64_t *value);
+
+int msg_builder_init(uds_msg_builder_t *b, void *buf, size_t size,
+    uint32_t command, unsigned int count);
+int msg_add_bytes(uds_msg_builder_t *b, unsigned int field,
+    const void *data, uint32_t len);
+int msg_add_string(uds_msg_builder_t *b, unsigned int field,
+    const char *str);
+int msg_add_u32(uds_msg_builder_t *b, unsigned int field, uint32_t value);
+int msg_add_u64(uds_msg_builder_t *b, unsigned int field, uint64_t value);
+uds_command_t *msg_builder_finish(uds_msg_builder_t *b);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UDS_MSG_H_ */
@@ -0,0 +1,367 @@
+/******************************************************************************
+*
+* FILENAME:
+*     uds_proxy.c
+*
+* DESCRIPTION:
+*     A proxy concentrating the connections of many (short-lived) clients on
+*     a few long-lived connections to the server. The requests of clients
+*     are pipelined on the upstream connections, and the responses are
+*     matched in order: the server answers a connection in order, so the
+*     packets need no request id and are forwarded as they are.
+*
+* REVISION(MM/DD/YYYY):
+*     10/18/2026
+*     - Initial version
+*
+******************************************************************************/
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include "common.h"
+
+/* The default count of upstream connections */
+#define PROXY_UPSTREAMS         2
+
+/* Max count of upstream connections */
+#define PROXY_MAX_UPSTREAMS     16
+
+
+/* A request waiting for its response from upstream */
+typedef struct proxy_waiter {
+    struct proxy_waiter *next;  /* The next request sent after it */
+    uds_command_t *resp;        /* The response, NULL: failed */
+    int done;                   /* 1: the response is got or failed */
+    pthread_cond_t cond;        /* Signaled when done */
+} proxy_waiter_t;
+
+/* A pipelined connection to the server */
+typedef struct proxy_upstream {
+    pthread_mutex_t send_lock;  /* Held to send, or to close clnt; keeps the
+                                   order of send the same as the queue */
+    pthread_mutex_t lock;       /* Protects the fields below */
+    uds_client_t *clnt;         /* The connection, NULL: disconnected */
+    proxy_waiter_t *head;       /* Requests in flight, the oldest first */
+    proxy_waiter_t *tail;       /* The latest request in flight */
+    int inflight;               /* Count of requests in flight */
+    pthread_t reader;           /* Thread receiving the responses */
+    struct proxy *proxy;        /* The proxy who owns it */
+} proxy_upstream_t;
+
+/* The proxy */
+typedef struct proxy {
+    const char *path;                   /* Socket path of the server */
+    uds_client_config_t config;         /* Config of upstream connections */
+    proxy_upstream_t up[PROXY_MAX_UPSTREAMS];   /* Upstream connections */
+    int count;                          /* Count of upstream connections */
+    uint64_t forwarded;                 /* Requests answered by server */
+    uint64_t failed;                    /* Requests failed in upstream */
+} proxy_t;
+
+
+volatile sig_atomic_t loop_flag = 1;
+
+
+/*
+ * Close a broken upstream connection, the requests in flight on it fail.
+ * Called by the reader thread with both locks held.
+ */
+void upstream_fail(proxy_upstream_t *up)
+{
+    proxy_waiter_t *w;
+
+    client_close(up->clnt);
+    __atomic_store_n(&up->clnt, NULL, __ATOMIC_RELAXED);
+    while (up->head != NULL) {
+        w = up->head;
+        up->head = w->next;
+        w->done = 1;
+        pthread_cond_signal(&w->cond);
+        __atomic_add_fetch(&up->proxy->failed, 1, __ATOMIC_RELAXED);
+    }
+    up->tail = NULL;
+    __atomic_store_n(&up->inflight, 0, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Thread of an upstream connection: connect to the server, and give the
+ * responses to the requests in flight in order. Only this thread receives
+ * from and closes the connection.
+ */
+void *upstream_reader(void *arg)
+{
+    proxy_upstream_t *up = (proxy_upstream_t *)arg;
+    proxy_t *p = up->proxy;
+    uds_command_t *resp;
+    uds_client_t *clnt;
+    proxy_waiter_t *w;
+
+    while (loop_flag) {
+        /* Reconnect, retry a second later if it fails */
+        if (up->clnt == NULL) {
+            clnt = client_init_config(p->path, &p->config);
+            if (clnt == NULL) {
+                sleep(1);
+                continue;
+            }
+            pthread_mutex_lock(&up->lock);
+            __atomic_store_n(&up->clnt, clnt, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&up->lock);
+            continue;
+        }
+
+        resp = client_recv_response(up->clnt);
+        pthread_mutex_lock(&up->lock);
+        if ((resp != NULL) && (up->head != NULL)) {
+            w = up->head;
+            up->head = w->next;
+            if (up->head == NULL) {
+                up->tail = NULL;
+            }
+            __atomic_sub_fetch(&up->inflight, 1, __ATOMIC_RELAXED);
+            w->resp = resp;
+            w->done = 1;
+            pthread_cond_signal(&w->cond);
+            __atomic_add_fetch(&p->forwarded, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&up->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&up->lock);
+
+        /* A broken connection or a bad packet, the stream can't be
+         * matched any more. Shut it down to fail a blocked send, and
+         * close it once no request is being sent */
+        if (resp == NULL) {
+            printf("proxy: upstream connection lost\n");
+        } else {
+            printf("proxy: unexpected response from upstream\n");
+            uds_free(resp);
+        }
+        shutdown(up->clnt->sockfd, SHUT_RDWR);
+        pthread_mutex_lock(&up->send_lock);
+        pthread_mutex_lock(&up->lock);
+        upstream_fail(up);
+        pthread_mutex_unlock(&up->lock);
+        pthread_mutex_unlock(&up->send_lock);
+    }
+
+    pthread_mutex_lock(&up->send_lock);
+    pthread_mutex_lock(&up->lock);
+    if (up->clnt != NULL) {
+        upstream_fail(up);
+    }
+    pthread_mutex_unlock(&up->lock);
+    pthread_mutex_unlock(&up->send_lock);
+    return NULL;
+}
+
+
+/*
+ * Pick the connected upstream with the fewest requests in flight.
+ */
+proxy_upstream_t *pick_upstream(proxy_t *p)
+{
+    proxy_upstream_t *best = NULL;
+    int i, n, best_n = 0;
+
+    for (i = 0; i < p->count; i++) {
+        if (__atomic_load_n(&p->up[i].clnt, __ATOMIC_RELAXED) == NULL) {
+            continue;
+        }
+        n = __atomic_load_n(&p->up[i].inflight, __ATOMIC_RELAXED);
+        if ((best == NULL) || (n < best_n)) {
+            best = &p->up[i];
+            best_n = n;
+        }
+    }
+
+    return best;
+}
+
+
+/*
+ * Request handler of the proxy: forward the request on an upstream
+ * connection, and wait for its response.
+ */
+uds_command_t *proxy_forward(void *ctx, uds_command_t *req)
+{
+    proxy_t *p = (proxy_t *)ctx;
+    proxy_upstream_t *up;
+    uds_client_t *clnt;
+    proxy_waiter_t w;
+
+    up = pick_upstream(p);
+    if (up == NULL) {
+        __atomic_add_fetch(&p->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    memset(&w, 0, sizeof(w));
+    pthread_cond_init(&w.cond, NULL);
+
+    /* Queue and send under the send lock, so requests are sent in the
+     * order of the queue. The reader doesn't wait for a send, except to
+     * close a broken connection */
+    pthread_mutex_lock(&up->send_lock);
+    pthread_mutex_lock(&up->lock);
+    clnt = up->clnt;
+    if (clnt == NULL) {
+        pthread_mutex_unlock(&up->lock);
+        pthread_mutex_unlock(&up->send_lock);
+        pthread_cond_destroy(&w.cond);
+        __atomic_add_fetch(&p->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (up->tail != NULL) {
+        up->tail->next = &w;
+    } else {
+        up->head = &w;
+    }
+    up->tail = &w;
+    __atomic_add_fetch(&up->inflight, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&up->lock);
+
+    /* The reader fails all requests in flight when it sees the shutdown */
+    if (client_post_request(clnt, req) != 0) {
+        shutdown(clnt->sockfd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&up->send_lock);
+
+    pthread_mutex_lock(&up->lock);
+    while (!w.done) {
+        pthread_cond_wait(&w.cond, &up->lock);
+    }
+    pthread_mutex_unlock(&up->lock);
+
+    pthread_cond_destroy(&w.cond);
+    return w.resp;
+}
+
+
+/*
+ * When user press CTRL+C, quit the proxy process.
+ */
+void handler_sigint(int sig)
+{
+    loop_flag = 0;
+}
+
+void install_sig_handler()
+{
+    struct sigaction act;
+
+    sigemptyset(&act.sa_mask);
+    act.sa_handler = handler_sigint;
+    act.sa_flags = 0;
+    sigaction(SIGINT, &act, 0);
+}
+
+
+void usage(const char *prog)
+{
+    printf("Usage: %s [-l path] [-u path] [-n count]\n", prog);
+    printf("  -l path   Socket path to accept clients (default %s)\n",
+        UDS_PROXY_SOCK_PATH);
+    printf("  -u path   Socket path of the server (default %s)\n",
+        UDS_SOCK_PATH);
+    printf("  -n count  Count of upstream connections (default %d)\n",
+        PROXY_UPSTREAMS);
+    printf("The configuration can be overridden by environment variables,\n");
+    printf("e.g. UDS_MAX_CLIENT=100\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    static proxy_t p;
+    uds_server_t *s;
+    uds_server_config_t cfg;
+    uds_stats_t st;
+    const char *listen_path = UDS_PROXY_SOCK_PATH;
+    int opt, i;
+
+    p.path = UDS_SOCK_PATH;
+    p.count = PROXY_UPSTREAMS;
+    while ((opt = getopt(argc, argv, "l:u:n:h")) != -1) {
+        switch (opt) {
+        case 'l':
+            listen_path = optarg;
+            break;
+
+        case 'u':
+            p.path = optarg;
+            break;
+
+        case 'n':
+            p.count = atoi(optarg);
+            if ((p.count <= 0) || (p.count > PROXY_MAX_UPSTREAMS)) {
+                printf("proxy: count of upstreams shall be 1~%d\n",
+                    PROXY_MAX_UPSTREAMS);
+                return STATUS_ERROR;
+            }
+            break;
+
+        default:
+            usage(argv[0]);
+            return STATUS_ERROR;
+        }
+    }
+
+    server_config_init(&cfg);
+    client_config_init(&p.config);
+    if ((server_config_load_env(&cfg) != 0) ||
+            (client_config_load_env(&p.config) != 0)) {
+        return STATUS_INIT_ERROR;
+    }
+
+    /* The reader waits for responses as long as requests are in flight */
+    p.config.connect_timeout = 0;
+    p.config.recv_timeout = 0;
+
+    s = server_init_config(listen_path, NULL, &cfg);
+    if (s == NULL) {
+        printf("proxy: init error\n");
+        return STATUS_INIT_ERROR;
+    }
+    server_set_handler_ctx(s, proxy_forward, &p);
+
+    install_sig_handler();
+
+    for (i = 0; i < p.count; i++) {
+        p.up[i].proxy = &p;
+        pthread_mutex_init(&p.up[i].send_lock, NULL);
+        pthread_mutex_init(&p.up[i].lock, NULL);
+        if (pthread_create(&p.up[i].reader, NULL, upstream_reader,
+                &p.up[i]) != 0) {
+            perror("pthread_create error");
+            p.count = i;
+            loop_flag = 0;
+            break;
+        }
+    }
+
+    if (loop_flag) {
+        server_run(s, &loop_flag);
+    }
+
+    /* Wake up the readers blocked in receiving */
+    for (i = 0; i < p.count; i++) {
+        pthread_mutex_lock(&p.up[i].lock);
+        if (p.up[i].clnt != NULL) {
+            shutdown(p.up[i].clnt->sockfd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&p.up[i].lock);
+        pthread_join(p.up[i].reader, NULL);
+        pthread_mutex_destroy(&p.up[i].lock);
+        pthread_mutex_destroy(&p.up[i].send_lock);
+    }
+
+    server_get_stats(s, &st);
+    printf("Connections: %llu, requests: %llu\n",
+        (unsigned long long)st.connections, (unsigned long long)st.requests);
+    printf("Forwarded: %llu, failed: %llu\n",
+        (unsigned long long)p.forwarded, (unsigned long long)p.failed);
+    server_close(s);
+    return STATUS_SUCCESS;
+}
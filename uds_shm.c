@@ -0,0 +1,277 @@
+/******************************************************************************
+*
+* FILENAME:
+*     uds_shm.c
+*
+* DESCRIPTION:
+*     Primitives shared by processes through a shared mapping.
+*
+* REVISION(MM/DD/YYYY):
+*     10/18/2026
+*     - Initial version
+*
+******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "uds_shm.h"
+
+
+/******************************************************************************
+ * NAME:
+ *      doorbell_init
+ *
+ * DESCRIPTION: 
+ *      Initialize a doorbell in a shared mapping.
+ *
+ * PARAMETERS:
+ *      db - The doorbell
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void doorbell_init(uds_doorbell_t *db)
+{
+    __atomic_store_n(&db->seq, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&db->sleeping, 0, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      doorbell_seq
+ *
+ * DESCRIPTION: 
+ *      Get the sequence of a doorbell. The consumer reads it before checking
+ *      the shared data, and waits with it when there is nothing to do, so a
+ *      ring in between is not lost.
+ *
+ * PARAMETERS:
+ *      db - The doorbell
+ *
+ * RETURN:
+ *      The sequence
+ ******************************************************************************/
+uint32_t doorbell_seq(uds_doorbell_t *db)
+{
+    return __atomic_load_n(&db->seq, __ATOMIC_ACQUIRE);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      doorbell_ring
+ *
+ * DESCRIPTION: 
+ *      Ring a doorbell after publishing the shared data. FUTEX_WAKE is only
+ *      called when a waiter has marked itself sleeping, so ringing a busy
+ *      consumer costs no syscall.
+ *
+ * PARAMETERS:
+ *      db - The doorbell
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void doorbell_ring(uds_doorbell_t *db)
+{
+    /* Both sides use sequentially consistent order: either the producer
+     * sees the waiter sleeping, or the waiter sees the new sequence */
+    __atomic_add_fetch(&db->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&db->sleeping, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+
+    /* Not FUTEX_PRIVATE_FLAG, the waiter may be another process */
+    if (syscall(SYS_futex, &db->seq, FUTEX_WAKE, INT32_MAX,
+            NULL, NULL, 0) < 0) {
+        perror("futex(FUTEX_WAKE) error");
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      doorbell_wait
+ *
+ * DESCRIPTION: 
+ *      Sleep until the doorbell is rung after the sequence "seen" was read,
+ *      or timeout.
+ *
+ * PARAMETERS:
+ *      db         - The doorbell
+ *      seen       - The sequence read by doorbell_seq()
+ *      timeout_ms - Max time to sleep(ms), negative: forever
+ *
+ * RETURN:
+ *      1 - Rung, 0 - Timeout or interrupted by signal
+ ******************************************************************************/
+int doorbell_wait(uds_doorbell_t *db, uint32_t seen, int timeout_ms)
+{
+    struct timespec ts;
+    long rc;
+
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    __atomic_add_fetch(&db->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&db->seq, __ATOMIC_SEQ_CST) != seen) {
+        __atomic_sub_fetch(&db->sleeping, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    /* The kernel checks the sequence again before sleeping */
+    rc = syscall(SYS_futex, &db->seq, FUTEX_WAIT, seen,
+        (timeout_ms < 0) ? NULL : &ts, NULL, 0);
+    if ((rc < 0) && (errno != EAGAIN) && (errno != ETIMEDOUT) &&
+            (errno != EINTR)) {
+        perror("futex(FUTEX_WAIT) error");
+    }
+    __atomic_sub_fetch(&db->sleeping, 1, __ATOMIC_RELAXED);
+
+    return (__atomic_load_n(&db->seq, __ATOMIC_ACQUIRE) != seen);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      snapshot_init
+ *
+ * DESCRIPTION: 
+ *      Initialize an empty snapshot in a shared mapping of
+ *      sizeof(uds_snapshot_t) + size bytes.
+ *
+ * PARAMETERS:
+ *      snap - The snapshot
+ *      size - Capacity of the data
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void snapshot_init(uds_snapshot_t *snap, size_t size)
+{
+    snap->size = (uint32_t)size;
+    snap->len = 0;
+    __atomic_store_n(&snap->seq, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&snap->magic, UDS_SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      snapshot_publish
+ *
+ * DESCRIPTION: 
+ *      Publish a new version of the data. Writers are serialized by the
+ *      seqlock, readers are never blocked but retry while it is written.
+ *
+ * PARAMETERS:
+ *      snap - The snapshot
+ *      data - The data
+ *      len  - Length of the data, no more than the capacity
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int snapshot_publish(uds_snapshot_t *snap, const void *data, size_t len)
+{
+    uint32_t seq;
+
+    if (len > snap->size) {
+        printf("Error: snapshot data too large (%zu > %u)\n", len,
+            snap->size);
+        return -1;
+    }
+
+    /* Lock the seqlock by making the sequence odd */
+    seq = __atomic_load_n(&snap->seq, __ATOMIC_RELAXED);
+    while ((seq & 1) || !__atomic_compare_exchange_n(&snap->seq, &seq,
+            seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        sched_yield();
+        seq = __atomic_load_n(&snap->seq, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(snap + 1, data, len);
+    snap->len = (uint32_t)len;
+
+    __atomic_store_n(&snap->seq, seq + 2, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      snapshot_version
+ *
+ * DESCRIPTION: 
+ *      Get the version of the data, a reader keeping a copy checks it on
+ *      every use and reads the data again only if it is changed.
+ *
+ * PARAMETERS:
+ *      snap - The snapshot
+ *
+ * RETURN:
+ *      The version, 0: nothing published yet
+ ******************************************************************************/
+uint32_t snapshot_version(const uds_snapshot_t *snap)
+{
+    return __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE) / 2;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      snapshot_read
+ *
+ * DESCRIPTION: 
+ *      Copy a consistent version of the data, without any write to the
+ *      shared mapping, so it can be mapped read-only.
+ *
+ * PARAMETERS:
+ *      snap    - The snapshot
+ *      buf     - The buffer to copy the data to
+ *      size    - Size of the buffer
+ *      version - Return the version of the data, can be NULL
+ *
+ * RETURN:
+ *      Length of the data, -1 if the buffer is too small, or the writer
+ *      holds the seqlock too long (it may be dead).
+ ******************************************************************************/
+ssize_t snapshot_read(const uds_snapshot_t *snap, void *buf, size_t size,
+    uint32_t *version)
+{
+    uint32_t seq, len;
+    int i;
+
+    for (i = 0; i < UDS_SNAPSHOT_RETRIES; i++) {
+        seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        /* The length may be torn as well, copy nothing until checked */
+        len = __atomic_load_n(&snap->len, __ATOMIC_RELAXED);
+        if ((len <= size) && (len <= snap->size)) {
+            memcpy(buf, snap + 1, len);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&snap->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        if ((len > size) || (len > snap->size)) {
+            return -1;
+        }
+        if (version != NULL) {
+            *version = seq / 2;
+        }
+        return len;
+    }
+
+    return -1;
+}
@@ -0,0 +1,58 @@
+/******************************************************************************
+*
+* FILENAME:
+*     uds_shm.h
+*
+* DESCRIPTION:
+*     Primitives shared by processes through a shared mapping.
+*
+* REVISION(MM/DD/YYYY):
+*     10/18/2026
+*     - Initial version
+*
+******************************************************************************/
+#ifndef _UDS_SHM_H_
+#define _UDS_SHM_H_
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* A doorbell to wake the peer who waits for new data in shared memory. The
+ * producer makes a syscall only when the consumer is sleeping */
+typedef struct uds_doorbell {
+    uint32_t seq;               /* Bumped on each ring, the futex word */
+    uint32_t sleeping;          /* Count of waiters sleeping in futex */
+} uds_doorbell_t;
+
+
+/* Magic of a snapshot mapping, "UDSS" */
+#define UDS_SNAPSHOT_MAGIC      0x53534455
+
+/* Times a reader retries while the snapshot is being written */
+#define UDS_SNAPSHOT_RETRIES    1000
+
+/* Header of a snapshot of read-mostly data, followed by the data. It is
+ * written by one side and read by the others with plain loads, protected by
+ * a seqlock: seq is odd while it is being written, and seq / 2 is the
+ * version of the data */
+typedef struct uds_snapshot {
+    uint32_t magic;             /* UDS_SNAPSHOT_MAGIC */
+    uint32_t seq;               /* Sequence of the seqlock */
+    uint32_t len;               /* Length of the data published */
+    uint32_t size;              /* Capacity of the data */
+} uds_snapshot_t;
+
+
+void doorbell_init(uds_doorbell_t *db);
+uint32_t doorbell_seq(uds_doorbell_t *db);
+void doorbell_ring(uds_doorbell_t *db);
+int doorbell_wait(uds_doorbell_t *db, uint32_t seen, int timeout_ms);
+
+void snapshot_init(uds_snapshot_t *snap, size_t size);
+int snapshot_publish(uds_snapshot_t *snap, const void *data, size_t len);
+uint32_t snapshot_version(const uds_snapshot_t *snap);
+ssize_t snapshot_read(const uds_snapshot_t *snap, void *buf, size_t size,
+    uint32_t *version);
+
+
+#endif /* _UDS_SHM_H_ */